@@ -0,0 +1,288 @@
+/*
+ * File: adaptive.hpp
+ * ------------------
+ *
+ * Defines a class AdaptiveMesh that samples a function on [-length, length]^2
+ * with a restricted quadtree instead of a uniform grid. Starting from a grid
+ * of BASE x BASE cells, the cells with the largest error are split until the
+ * error is below a tolerance or the sample budget is used up.
+ *
+ * The error of a cell compares the value at its center with the first order
+ * predictions from its corners (value and derivatives), so it measures the
+ * curvature across the cell. Values beyond the visible range are clamped,
+ * non-finite ones split the cell down to the smallest size.
+ *
+ * Neighbouring cells differ by one level at most, so an edge has at most one
+ * vertex in its middle, a corner of the finer neighbour. Each leaf is
+ * triangulated as a fan around its center, splitting the edges at those
+ * vertices, so the mesh has no cracks.
+ */
+
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <complex>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+class AdaptiveMesh
+{
+public:
+    struct Sample {
+        double x, y;
+        std::complex<double> value, dx, dy; // f and its partial derivatives
+    };
+
+    // Evaluates f at n points (x, y): value, df/dx and df/dy of point i go to
+    // re[k*n + i] and im[k*n + i] for k = 0, 1, 2 (like Program::batch with
+    // gradients). Called by several threads at once.
+    using Evaluator = std::function<void(int n, const double* x, const double* y, double* re, double* im)>;
+
+    // Mesh of about the quality of a resolution x resolution grid, with at
+    // most budget samples. Stops early if cancel is set.
+    AdaptiveMesh(double length, int resolution, size_t budget, Evaluator eval, const std::atomic<bool>* cancel = nullptr)
+      : length(length), eval(std::move(eval)), cancel(cancel)
+    {
+        // The smallest cells are a quarter of the grid's, 2 lattice units wide
+        roots = std::min(BASE, std::max(1, resolution - 1));
+        int depth = 0;
+        while ((roots << depth) < 4 * (resolution - 1) && depth < MAX_DEPTH)
+            ++depth;
+        rootSize = 2 << depth;
+        lattice = roots * rootSize;
+        tolerance = TOLERANCE * 2.0 * length / std::max(1, resolution - 1);
+
+        samples_.reserve(budget + budget / 4);
+        std::vector<uint32_t> grid;
+        for (int j=0; j <= roots; ++j)
+            for (int i=0; i <= roots; ++i)
+                grid.push_back(sample(i * rootSize, j * rootSize));
+        for (int j=0; j < roots; ++j)
+            for (int i=0; i < roots; ++i) {
+                const int k = i + j * (roots + 1);
+                addCell(i * rootSize, j * rootSize, rootSize, { grid[k], grid[k + 1], grid[k + roots + 1], grid[k + roots + 2] });
+            }
+
+        // Only the leaves of the last round can have errors above the tolerance
+        size_t fresh = 0;
+        while (evaluate(fresh) && samples_.size() < budget) {
+            // Split the cells with the largest errors first, as far as the budget goes
+            std::vector<std::pair<float, int> > worst;
+            for (int c=fresh; c < (int)cells.size(); ++c)
+                if (cells[c].child < 0 && cells[c].size >= 4 && cells[c].error > tolerance)
+                    worst.push_back({ cells[c].error, c });
+            if (worst.empty())
+                break;
+            std::sort(worst.begin(), worst.end(), std::greater<>());
+
+            fresh = cells.size();
+            for (const auto& w : worst) {
+                if (samples_.size() >= budget)
+                    break;
+                if (cells[w.second].child < 0)
+                    split(w.second);
+            }
+        }
+
+        if (!cancelled())
+            triangulate();
+    }
+
+    const std::vector<Sample>& samples() const { return samples_; }
+    const std::vector<uint32_t>& triangles() const { return triangles_; }
+    const std::vector<uint32_t>& lines() const { return lines_; }
+
+    // The mesh is complete, not cancelled
+    bool complete() const { return !triangles_.empty(); }
+
+private:
+    static const int BASE = 16;          // Cells per row at the start
+    static const int MAX_DEPTH = 12;     // Levels of splits
+    static const int BLOCK = 256;        // Points per evaluation
+    static constexpr double TOLERANCE = 0.02; // Error allowed, relative to the grid's step
+
+    struct Cell {
+        int u, v, size;        // Lower left corner and size, in lattice units
+        uint32_t corners[4];   // Samples at (u, v), (u+size, v), (u, v+size), (u+size, v+size)
+        uint32_t center;
+        int child = -1;        // First of the four children (in the order of the corners), -1 for a leaf
+        float error = -1;      // Of the leaf
+    };
+
+    double length;
+    Evaluator eval;
+    const std::atomic<bool>* cancel;
+
+    int roots;         // Root cells per row
+    int rootSize;      // Size of the root cells in lattice units
+    int lattice;       // Lattice points per row - 1
+    double tolerance;
+
+    std::vector<Cell> cells; // The roots first, row by row
+    std::vector<Sample> samples_;
+    size_t evaluated = 0;    // Samples before are evaluated
+    std::vector<uint32_t> triangles_, lines_;
+
+    bool cancelled() const { return cancel && *cancel; }
+
+    // New sample at lattice point (u, v)
+    uint32_t sample(int u, int v)
+    {
+        const double scale = 2.0 * length / lattice;
+        samples_.push_back({ -length + u * scale, -length + v * scale, {}, {}, {} });
+        return samples_.size() - 1;
+    }
+
+    void addCell(int u, int v, int size, std::initializer_list<uint32_t> corners)
+    {
+        Cell cell = { u, v, size, {}, sample(u + size / 2, v + size / 2) };
+        std::copy(corners.begin(), corners.end(), cell.corners);
+        cells.push_back(cell);
+    }
+
+    // Leaf containing the lattice point (u, v), -1 outside the domain
+    int leafAt(int u, int v) const
+    {
+        if (u < 0 || v < 0 || u >= lattice || v >= lattice)
+            return -1;
+        int c = (v / rootSize) * roots + u / rootSize;
+        while (cells[c].child >= 0) {
+            const Cell& cell = cells[c];
+            const int h = cell.size / 2;
+            c = cell.child + (u >= cell.u + h) + 2 * (v >= cell.v + h);
+        }
+        return c;
+    }
+
+    // Leaf next to the middle of edge k (bottom, right, top, left) of cell c, -1 at the border
+    int neighbour(int c, int k) const
+    {
+        const Cell& cell = cells[c];
+        const int u = cell.u, v = cell.v, s = cell.size, h = s / 2;
+        const int outside[4][2] = { { u + h, v - 1 }, { u + s, v + h }, { u + h, v + s }, { u - 1, v + h } };
+        return leafAt(outside[k][0], outside[k][1]);
+    }
+
+    // Sample in the middle of edge k of cell c, a corner of the finer neighbour, -1 if none
+    int64_t middle(int c, int k) const
+    {
+        static const int corner[4] = { 2, 0, 0, 1 }; // Of the neighbour, at the middle
+        const int n = neighbour(c, k);
+        if (n < 0 || cells[n].size >= cells[c].size)
+            return -1;
+        return cells[n].corners[corner[k]];
+    }
+
+    // Split cell c into four, after the neighbours that would be more than one level coarser
+    void split(int c)
+    {
+        for (int k=0; k < 4; ++k) {
+            const int n = neighbour(c, k);
+            if (n >= 0 && cells[n].size > cells[c].size)
+                split(n);
+        }
+
+        const Cell cell = cells[c];
+        const int u = cell.u, v = cell.v, h = cell.size / 2;
+        const int middles[4][2] = { { u + h, v }, { u + 2*h, v + h }, { u + h, v + 2*h }, { u, v + h } };
+        uint32_t mid[4];
+        for (int k=0; k < 4; ++k) {
+            const int64_t m = middle(c, k);
+            mid[k] = m >= 0 ? m : sample(middles[k][0], middles[k][1]);
+        }
+
+        const uint32_t *p = cell.corners, m = cell.center;
+        cells[c].child = cells.size();
+        addCell(u, v, h, { p[0], mid[0], mid[3], m });
+        addCell(u + h, v, h, { mid[0], p[1], m, mid[1] });
+        addCell(u, v + h, h, { mid[3], m, p[2], mid[2] });
+        addCell(u + h, v + h, h, { m, mid[1], mid[2], p[3] });
+    }
+
+    // Evaluate the new samples and the errors of the leaves from cell first on, returns false if cancelled
+    bool evaluate(size_t first)
+    {
+        tbb::parallel_for(tbb::blocked_range<size_t>(evaluated, samples_.size(), BLOCK), [&](const tbb::blocked_range<size_t>& r) {
+            if (cancelled())
+                return;
+            const int n = r.size();
+            std::vector<double> xs(n), ys(n), re(3*n), im(3*n);
+            for (int i=0; i < n; ++i) {
+                xs[i] = samples_[r.begin() + i].x;
+                ys[i] = samples_[r.begin() + i].y;
+            }
+            eval(n, xs.data(), ys.data(), re.data(), im.data());
+            for (int i=0; i < n; ++i) {
+                Sample& p = samples_[r.begin() + i];
+                p.value = { re[i], im[i] };
+                p.dx = { re[n + i], im[n + i] };
+                p.dy = { re[2*n + i], im[2*n + i] };
+            }
+        });
+        evaluated = samples_.size();
+        if (cancelled())
+            return false;
+
+        for (size_t c=first; c < cells.size(); ++c)
+            if (cells[c].child < 0)
+                cells[c].error = error(cells[c]);
+        return true;
+    }
+
+    // Largest difference of the center's value to the predictions from the corners
+    float error(const Cell& cell) const
+    {
+        auto clamp = [this](double x) { return std::clamp(x, -length, length); };
+        auto finite = [](std::complex<double> z) { return std::isfinite(z.real()) && std::isfinite(z.imag()); };
+
+        const Sample& m = samples_[cell.center];
+        if (!finite(m.value))
+            return INFINITY;
+
+        double e = 0.0;
+        for (uint32_t corner : cell.corners) {
+            const Sample& p = samples_[corner];
+            if (!finite(p.value) || !finite(p.dx) || !finite(p.dy))
+                return INFINITY;
+            std::complex<double> predicted = p.value + p.dx * (m.x - p.x) + p.dy * (m.y - p.y);
+            e = std::max({ e, std::abs(clamp(m.value.real()) - clamp(predicted.real())),
+                              std::abs(clamp(m.value.imag()) - clamp(predicted.imag())) });
+        }
+        return e;
+    }
+
+    // Fans around the centers of the leaves, and their edges once each
+    void triangulate()
+    {
+        for (int c=0; c < (int)cells.size(); ++c) {
+            const Cell& cell = cells[c];
+            if (cell.child >= 0)
+                continue;
+
+            // Edges counterclockwise: bottom, right, top, left
+            const uint32_t* p = cell.corners;
+            const uint32_t edges[4][2] = { { p[0], p[1] }, { p[1], p[3] }, { p[3], p[2] }, { p[2], p[0] } };
+
+            for (int k=0; k < 4; ++k) {
+                const uint32_t a = edges[k][0], b = edges[k][1];
+                const int64_t mid = middle(c, k);
+                if (mid >= 0) {
+                    // The finer neighbour draws the halves, as its own edges
+                    triangles_.insert(triangles_.end(), { cell.center, a, (uint32_t)mid, cell.center, (uint32_t)mid, b });
+                    continue;
+                }
+                triangles_.insert(triangles_.end(), { cell.center, a, b });
+
+                // Bottom and left edges, the right and top ones only to the border or a coarser leaf
+                const int n = neighbour(c, k);
+                if (k == 0 || k == 3 || n < 0 || cells[n].size > cell.size)
+                    lines_.insert(lines_.end(), { a, b });
+            }
+        }
+    }
+};
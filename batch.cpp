@@ -0,0 +1,304 @@
+/*
+ * File: batch.cpp
+ * ---------------
+ *
+ * Evaluates an expression on a grid without the GUI, e.g. on machines
+ * without a display. The points, values and normals are the ones of the
+ * canvas' CPU evaluation (Canvas::calcGraph): single precision coordinates,
+ * the rows evaluated in parallel by the native code of the program.
+ *
+ * Usage: batch [options] expression
+ *   -r points   Points per row and column (default 1001)
+ *   -l length   The grid covers center +- length (default 10)
+ *   -x center   Center of the grid in x (default 0)
+ *   -y center   Center of the grid in y (default 0)
+ *   -v          Values only, no normals (like the heightfield)
+ *   -f format   bin (default, see gridfile.hpp) or csv
+ *   -z          Compress bin with zstd (if built with 'make ZSTD=1')
+ *   -o file     Output file (default stdout)
+ *   -b rows     Stream the grid in bands of rows, with difference normals (see below)
+ *
+ * The csv format has a line x,y,re,im(,sre_x,sre_y,sim_x,sim_y) per point,
+ * row by row, with the slopes of the normals (-df/dx, -df/dy, clamped).
+ *
+ * Grids larger than the memory are streamed in bands: each band is evaluated
+ * in parallel while the last one is written, so only two bands are in memory.
+ * The values are evaluated without derivatives, the normals are differences
+ * to the neighbouring points like in the heightfield shader (one-sided at the
+ * edges), with a row above and below the band as halo. The binary format
+ * marks them with the DIFFERENCES flag (see gridfile.hpp), and with normals
+ * it needs a file to seek in (-o, or stdout redirected to a file).
+ * Archives can not be streamed, the zstd tool compresses the file instead.
+ */
+
+#include <iostream>
+#include <complex>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+#include <thread>
+#include <unistd.h>
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#include "expr.hpp"
+#include "program.hpp"
+#include "functions.hpp"
+#include "jit.hpp"
+#include "gridfile.hpp"
+#include "evaluation.hpp"
+
+using namespace std;
+
+typedef complex<double> MyT;
+
+struct Settings {
+    int resolution = 1001;
+    float axisLength = 10.0f;
+    float centerX = 0.0f, centerY = 0.0f;
+    bool normals = true;
+    bool csv = false;
+    bool compress = false;
+    string output; // Empty for stdout
+    int band = 0;  // Rows per band, 0 to evaluate the grid at once
+};
+
+// Evaluate rows [j0, j1) of the grid like Canvas::calcGraph: (re, im) pairs to
+// values, the slopes of the normals to normals (if not nullptr, else like
+// calcHeightfield). Both start at row j0.
+static void evaluate(const Program<MyT>& program, const Jit& jit, const Settings& s, int j0, int j1, float* values, float* normals)
+{
+    const int res = s.resolution;
+    const float length = s.axisLength;
+    const int outputs = normals ? 3 : 1; // Value and its derivatives
+
+    tbb::parallel_for(tbb::blocked_range<int>(j0, j1), [&](const tbb::blocked_range<int>& rows) {
+        vector<double> xs(res), ys(res), re(outputs * res), im(outputs * res);
+        for (int i=0; i < res; ++i)
+            xs[i] = gridPoint(s.centerX, length, res, i);
+
+        for (int j=rows.begin(); j != rows.end(); ++j) {
+            std::fill(ys.begin(), ys.end(), gridPoint(s.centerY, length, res, j));
+            evalPoints(program, &jit, res, xs.data(), ys.data(), re.data(), im.data());
+
+            float* value = values + 2 * (size_t)(j - j0) * res;
+            for (int i=0; i < res; ++i) {
+                value[2 * i] = (float)re[i];
+                value[2 * i + 1] = (float)im[i];
+            }
+            if (!normals)
+                continue;
+            const double *dxRe = re.data() + res, *dyRe = dxRe + res;
+            const double *dxIm = im.data() + res, *dyIm = dxIm + res;
+            float* normal = normals + 4 * (size_t)(j - j0) * res;
+            for (int i=0; i < res; ++i) {
+                normal[4 * i] = slope(dxRe[i]);
+                normal[4 * i + 1] = slope(dyRe[i]);
+                normal[4 * i + 2] = slope(dxIm[i]);
+                normal[4 * i + 3] = slope(dyIm[i]);
+            }
+        }
+    });
+}
+
+// Slopes of the normals of rows [j0, j1) from the differences of the values,
+// like the heightfield shader. values holds rows j0 - 1 to j1, those within the
+// grid, normals starts at row j0.
+static void differences(const Settings& s, int j0, int j1, const float* values, float* normals)
+{
+    const int res = s.resolution;
+    const float step = 2.0f * s.axisLength / (res-1);
+    auto value = [&](int i, int j) { return values + 2 * (i + (size_t)(j - j0 + 1) * res); };
+
+    tbb::parallel_for(tbb::blocked_range<int>(j0, j1), [&](const tbb::blocked_range<int>& rows) {
+        for (int j=rows.begin(); j != rows.end(); ++j) {
+            const int jm = max(j - 1, 0), jp = min(j + 1, res - 1);
+            float* normal = normals + 4 * (size_t)(j - j0) * res;
+            for (int i=0; i < res; ++i) {
+                const int im = max(i - 1, 0), ip = min(i + 1, res - 1);
+                const float *l = value(im, j), *r = value(ip, j), *d = value(i, jm), *u = value(i, jp);
+                const float dx = (ip - im) * step, dy = (jp - jm) * step;
+                normal[4 * i] = slope((r[0] - l[0]) / dx);
+                normal[4 * i + 1] = slope((u[0] - d[0]) / dy);
+                normal[4 * i + 2] = slope((r[1] - l[1]) / dx);
+                normal[4 * i + 3] = slope((u[1] - d[1]) / dy);
+            }
+        }
+    });
+}
+
+// Rows [j0, j1) as csv, values and normals start at row j0
+static bool writeCsv(FILE* f, const Settings& s, int j0, int j1, const float* values, const float* normals)
+{
+    const int res = s.resolution;
+    const float length = s.axisLength;
+    for (int j=j0; j < j1; ++j) {
+        const float y = gridPoint(s.centerY, length, res, j);
+        for (int i=0; i < res; ++i) {
+            const size_t k = i + (size_t)(j - j0) * res;
+            const float x = gridPoint(s.centerX, length, res, i);
+            std::fprintf(f, "%.9g,%.9g,%.9g,%.9g", x, y, values[2 * k], values[2 * k + 1]);
+            if (normals)
+                std::fprintf(f, ",%.9g,%.9g,%.9g,%.9g", normals[4 * k], normals[4 * k + 1], normals[4 * k + 2], normals[4 * k + 3]);
+            std::fputc('\n', f);
+        }
+    }
+    return !std::ferror(f);
+}
+
+// Rows [j0, j1) in the binary format, at their offsets in the file
+static bool writeBin(FILE* f, const GridFile::Header& header, int j0, int j1, const float* values, const float* normals)
+{
+    const size_t res = header.resolution, first = j0 * res, n = (j1 - j0) * res;
+    // Without normals the bands follow each other, e.g. in a pipe
+    if (normals && fseeko(f, GridFile::valueOffset(first), SEEK_SET) != 0)
+        return false;
+    if (std::fwrite(values, 2 * sizeof(float), n, f) != n)
+        return false;
+    return !normals || (fseeko(f, GridFile::normalOffset(header, first), SEEK_SET) == 0 && std::fwrite(normals, 4 * sizeof(float), n, f) == n);
+}
+
+// Evaluate the grid band by band: the values of rows j0 - 1 to j1 of a band
+// (with the halo rows within the grid) are in one of two buffers, the last
+// band is written from the other one meanwhile. Its first two rows are the
+// last two of the previous band. Returns false if the grid can not be written.
+static bool stream(const Program<MyT>& program, const Jit& jit, const Settings& s, const GridFile::Header& header, FILE* f)
+{
+    const int res = s.resolution, band = s.band;
+    const size_t row = res;
+    vector<float> values[2], normals[2];
+    for (int b=0; b < 2; ++b) {
+        values[b].resize(2 * (band + 2) * row);
+        if (s.normals)
+            normals[b].resize(4 * band * row);
+    }
+
+    std::thread writer;
+    bool written = true;
+    for (int j0=0, b=0; j0 < res; j0 += band, b = 1 - b) {
+        const int j1 = min(j0 + band, res);
+        float* v = values[b].data();
+        if (j0 > 0) // Halo and first row, the last two rows of the previous (full) band
+            std::copy_n(values[1 - b].data() + 2 * band * row, 2 * 2 * row, v);
+
+        // Rows not evaluated yet, to the one after the band
+        const int e0 = j0 > 0 ? j0 + 1 : 0, e1 = min(j1 + 1, res);
+        evaluate(program, jit, s, e0, e1, v + 2 * (e0 - j0 + 1) * row, nullptr);
+        if (s.normals)
+            differences(s, j0, j1, v, normals[b].data());
+
+        if (writer.joinable())
+            writer.join();
+        if (!written)
+            return false;
+        const float* n = s.normals ? normals[b].data() : nullptr;
+        writer = std::thread([&, j0, j1, v, n] {
+            written = s.csv ? writeCsv(f, s, j0, j1, v + 2 * row, n) : writeBin(f, header, j0, j1, v + 2 * row, n);
+        });
+    }
+    writer.join();
+    return written;
+}
+
+static int usage()
+{
+    cerr << "Usage: batch [-r points] [-l length] [-x center] [-y center] [-v] [-f bin|csv] [-z] [-o file] [-b rows] expression" << endl;
+    return 2;
+}
+
+int main(int argc, char** argv)
+{
+    Settings s;
+    string format = "bin";
+    for (int c; (c = getopt(argc, argv, "r:l:x:y:vf:zo:b:")) != -1; ) {
+        switch (c) {
+            case 'r': s.resolution = atoi(optarg); break;
+            case 'l': s.axisLength = atof(optarg); break;
+            case 'x': s.centerX = atof(optarg); break;
+            case 'y': s.centerY = atof(optarg); break;
+            case 'v': s.normals = false; break;
+            case 'f': format = optarg; break;
+            case 'z': s.compress = true; break;
+            case 'o': s.output = optarg; break;
+            case 'b': s.band = atoi(optarg); break;
+            default: return usage();
+        }
+    }
+    if (optind != argc - 1 || s.resolution < 2 || !(s.axisLength > 0.0f) || (format != "bin" && format != "csv") || s.band < 0)
+        return usage();
+    s.csv = format == "csv";
+    if (s.band && s.compress) {
+        cerr << "Streamed grids can not be compressed, use the zstd tool on the file." << endl;
+        return 2;
+    }
+#ifndef WITH_ZSTD
+    if (s.compress) {
+        cerr << "Built without zstd, use 'make ZSTD=1'." << endl;
+        return 2;
+    }
+#endif
+
+    registerFunctions();
+    const string str = argv[optind];
+    unique_ptr<Program<MyT> > program;
+    unique_ptr<Jit> jit;
+    try {
+        Expr<MyT> expr(str);
+        expr.bind(exprVars, exprConsts);
+        // Streamed normals are differences of the values
+        program = s.normals && !s.band ? make_unique<Program<MyT> >(expr, exprRealVars, exprGradients)
+                                       : make_unique<Program<MyT> >(expr, exprRealVars);
+        jit = make_unique<Jit>(*program); // Runs the interpreter if not compiled
+    } catch (const std::invalid_argument& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+
+    GridFile::Header header;
+    header.flags = s.normals ? (s.band ? GridFile::NORMALS | GridFile::DIFFERENCES : GridFile::NORMALS) : 0;
+    header.expr = GridFile::hash(str);
+    header.centerX = s.centerX;
+    header.centerY = s.centerY;
+    header.axisLength = s.axisLength;
+    header.resolution = s.resolution;
+
+    FILE* f = s.output.empty() ? stdout : std::fopen(s.output.c_str(), "wb");
+    if (!f) {
+        cerr << "Can not open " << s.output << "." << endl;
+        return 1;
+    }
+    if (s.band && !s.csv && s.normals && ftello(f) < 0) {
+        cerr << "Streaming the binary format with normals needs a file (-o)." << endl;
+        return 2;
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    const size_t n = (size_t)s.resolution * s.resolution;
+    bool ok = true;
+    if (s.csv)
+        std::fprintf(f, s.normals ? "x,y,re,im,sre_x,sre_y,sim_x,sim_y\n" : "x,y,re,im\n");
+
+    if (s.band) {
+        ok = (s.csv || std::fwrite(&header, sizeof(header), 1, f) == 1) && stream(*program, *jit, s, header, f);
+    } else {
+        vector<float> values(2 * n), normals(s.normals ? 4 * n : 0);
+        evaluate(*program, *jit, s, 0, s.resolution, values.data(), s.normals ? normals.data() : nullptr);
+        auto evaluated = chrono::high_resolution_clock::now();
+        cerr << "Evaluated " << n << " points in " << chrono::duration_cast<chrono::milliseconds>(evaluated - start).count()
+             << " ms (" << (jit->compiled() ? "native code" : "interpreter") << ")." << endl;
+        start = evaluated;
+        ok = s.csv ? writeCsv(f, s, 0, s.resolution, values.data(), s.normals ? normals.data() : nullptr)
+                   : GridFile::write(f, header, values.data(), normals.data(), s.compress);
+    }
+
+    ok = (f == stdout ? std::fflush(f) : std::fclose(f)) == 0 && ok;
+    if (!ok) {
+        cerr << "Can not write the grid." << endl;
+        return 1;
+    }
+    cerr << (s.band ? "Evaluated and written in bands of " + to_string(s.band) + " rows in " : "Written in ")
+         << chrono::duration_cast<chrono::milliseconds>(chrono::high_resolution_clock::now() - start).count() << " ms." << endl;
+    return 0;
+}
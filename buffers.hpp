@@ -4,10 +4,17 @@
  *
  * Defines OpenGL-related classes for buffering and binding.
  * class Texture uploads and handles a given number of textures.
- * class VertexArray is responsible for one VAO and handles buffering of data.
+ * class FloatTexture holds one texture of float pairs (RG32F), for texelFetch.
+ * class BufferTexture reads the texels of a buffer (e.g. vertices), for texelFetch.
+ * class VertexArray is responsible for one VAO and handles buffering of data,
+ * copied from attribute maps or written in place into a mapped buffer of
+ * interleaved vertices, whose ranges can be updated (or read back) while it is drawn. It
+ * keeps one index buffer per primitive mode.
  */
 #pragma once
 
+#include <cstring>
+#include <cstdint>
 #include "shader.hpp"
 
 class Texture
@@ -68,10 +75,103 @@ private:
     std::vector<std::string> uniforms;
 };
 
+class FloatTexture
+{
+public:
+    FloatTexture() : texId(0), width(0), height(0) {}
+
+    ~FloatTexture()
+    {
+        glDeleteTextures(1, &texId);
+    }
+
+    void init()
+    {
+        glGenTextures(1, &texId);
+        glBindTexture(GL_TEXTURE_2D, texId);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+
+    // Upload w x h pairs, row by row
+    void buffer(const float* data, int w, int h)
+    {
+        glBindTexture(GL_TEXTURE_2D, texId);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        if (w != width || h != height) {
+            width = w;
+            height = h;
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RG32F, w, h, 0, GL_RG, GL_FLOAT, data);
+        } else {
+            glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, GL_RG, GL_FLOAT, data);
+        }
+    }
+
+    void use(const Shader& shader, const std::string& uniform, int unit=0)
+    {
+        shader.use();
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_2D, texId);
+        shader.uniform(uniform, unit);
+    }
+
+private:
+    GLuint texId;
+    int width, height;
+};
+
+class BufferTexture
+{
+public:
+    BufferTexture() : texId(0) {}
+
+    ~BufferTexture()
+    {
+        glDeleteTextures(1, &texId);
+    }
+
+    void init()
+    {
+        glGenTextures(1, &texId);
+    }
+
+    // Texels of the format from the buffer, e.g. RGBA32F for every 4 floats
+    void buffer(GLuint buffer, GLenum format=GL_RGBA32F)
+    {
+        glBindTexture(GL_TEXTURE_BUFFER, texId);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffer);
+    }
+
+    void use(const Shader& shader, const std::string& uniform, int unit=0)
+    {
+        shader.use();
+        glActiveTexture(GL_TEXTURE0 + unit);
+        glBindTexture(GL_TEXTURE_BUFFER, texId);
+        shader.uniform(uniform, unit);
+    }
+
+private:
+    GLuint texId;
+};
+
 class VertexArray
 {
 public:
-    VertexArray(int num_buffers=1) : ebo(0), num_vertices(0), num_buffers(num_buffers)
+    // Float attribute of an interleaved vertex type
+    struct Attribute {
+        std::string name;
+        GLint size;    // Number of floats
+        size_t offset; // Offset in the vertex, in bytes
+    };
+
+    // Vertices first to first + count - 1
+    struct Range {
+        size_t first, count;
+    };
+
+    VertexArray(int num_buffers=1) : num_vertices(0), num_buffers(num_buffers), mappings(num_buffers)
     {
         vbo = new GLuint[num_buffers]{0};
     }
@@ -80,6 +180,8 @@ public:
     {
         clear();
         delete[] vbo;
+        for (auto& e : ebos)
+            glDeleteBuffers(1, &e.second.ebo);
         glBindVertexArray(0);
         glDeleteVertexArrays(1, &vao);
     }
@@ -108,17 +210,24 @@ public:
         glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
         glDeleteBuffers(num_buffers, &vbo[buffer]);
         vbo[buffer] = 0;
+        mappings[buffer] = Mapping();
     }
 
-    void elements(const std::vector<int>& indices)
+    // Indices for draws in the given mode, 16 or 32 bit. The largest index of
+    // the type restarts a primitive (separates triangle strips).
+    template <class I=int>
+    void elements(const std::vector<I>& indices, GLenum mode=GL_TRIANGLES)
     {
         use();
-        if (!ebo) {
-            glGenBuffers(1, &ebo);
+        tag = 0;
+        Elements& e = ebos[mode];
+        if (!e.ebo) {
+            glGenBuffers(1, &e.ebo);
         }
-        num_vertices = indices.size();
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_vertices * sizeof(int), indices.data(), GL_STATIC_DRAW);
+        e.count = indices.size();
+        e.type = sizeof(I) == sizeof(GLushort) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, e.ebo);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(I), indices.data(), GL_STATIC_DRAW);
         glBindVertexArray(0);
         glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
         current = nullptr;
@@ -148,6 +257,9 @@ public:
             }
         }
 
+        if (mappings[buffer].persistent) {
+            clear(buffer); // Storage of a mapped buffer is immutable
+        }
         if (!vbo[buffer]) {
             glGenBuffers(1, &vbo[buffer]);
         }
@@ -165,26 +277,159 @@ public:
             glEnableVertexAttribArray(attribs[d.first]);
             offset += d.second[0].size() * sizeof(float);
         }
-        if (!ebo) {
+        num_vertices = n;
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Map the buffer for n vertices of type V, with the attributes of layout, so they
+    // can be written in place (by several threads). Where the driver has buffer
+    // storage (GL 4.4), the buffer stays mapped as long as n does not change. Call
+    // unmap before drawing, a buffer still mapped is returned again. Returns nullptr
+    // if the buffer can not be mapped.
+    template <class V>
+    V* map(size_t n, const std::vector<Attribute>& layout, const Shader& shader, int buffer=0)
+    {
+        Mapping& m = mappings[buffer];
+        const GLsizeiptr size = n * sizeof(V);
+
+        if (m.size != size || !vbo[buffer]) {
+            use();
+            clear(buffer);
+            glGenBuffers(1, &vbo[buffer]);
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
+            m.size = size;
+            m.persistent = GLEW_ARB_buffer_storage;
+            if (m.persistent) {
+                const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+                glBufferStorage(GL_ARRAY_BUFFER, size, nullptr, flags);
+                m.ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+            } else {
+                glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STATIC_DRAW);
+            }
+
+            for (const auto& a : layout) {
+                GLuint location = glGetAttribLocation(shader.id(), a.name.c_str());
+                glVertexAttribPointer(location, a.size, GL_FLOAT, GL_FALSE, sizeof(V), (void*) a.offset);
+                glEnableVertexAttribArray(location);
+            }
             num_vertices = n;
+        } else if (m.persistent) {
+            finishDraws(); // Still reading the old vertices
+        }
+
+        if (!m.persistent && !m.ptr) {
+            glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
+            m.ptr = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
         }
         glBindBuffer(GL_ARRAY_BUFFER, 0);
+        return static_cast<V*>(m.ptr);
     }
 
+    // Overwrite the ranges of a buffer created by map, with the vertices at the
+    // same indices of data. The buffer must not be mapped, or mapped persistently.
+    template <class V>
+    void update(const std::vector<Range>& ranges, const V* data, int buffer=0)
+    {
+        Mapping& m = mappings[buffer];
+        if (m.persistent) {
+            finishDraws();
+            for (const Range& r : ranges)
+                std::memcpy(static_cast<V*>(m.ptr) + r.first, data + r.first, r.count * sizeof(V));
+            return;
+        }
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
+        for (const Range& r : ranges)
+            glBufferSubData(GL_ARRAY_BUFFER, r.first * sizeof(V), r.count * sizeof(V), data + r.first);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Copy the first n vertices of a buffer created by map to data. The buffer
+    // must not be mapped, or mapped persistently.
+    template <class V>
+    void read(size_t n, V* data, int buffer=0)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
+        glGetBufferSubData(GL_ARRAY_BUFFER, 0, n * sizeof(V), data);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Name of the buffer, e.g. for a BufferTexture
+    GLuint vertexBuffer(int buffer=0) const
+    {
+        return vbo[buffer];
+    }
+
+    // The buffer stays mapped while drawn
+    bool persistent(int buffer=0) const
+    {
+        return mappings[buffer].persistent;
+    }
+
+    // Finish writing to the mapped buffer, returns false if its contents got lost
+    bool unmap(int buffer=0)
+    {
+        Mapping& m = mappings[buffer];
+        if (m.persistent || !m.ptr)
+            return true;
+
+        glBindBuffer(GL_ARRAY_BUFFER, vbo[buffer]);
+        bool ok = glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        m.ptr = nullptr;
+        return ok;
+    }
+
+    // Tag of the indices, set after uploading them to skip the next upload of
+    // the same ones, 0 after elements
+    uint64_t indexTag() const { return tag; }
+    void setIndexTag(uint64_t t) { tag = t; }
+
+    // Draw with the indices of mode, or all vertices in order if there are no indices
     void draw(GLenum mode=GL_TRIANGLES)
     {
         use();
-        if (ebo) {
-            glDrawElements(mode, num_vertices, GL_UNSIGNED_INT, 0);
-        } else if (num_vertices > 0) {
+        auto e = ebos.find(mode);
+        if (e != ebos.end()) {
+            const bool narrow = e->second.type == GL_UNSIGNED_SHORT;
+            glEnable(GL_PRIMITIVE_RESTART);
+            glPrimitiveRestartIndex(narrow ? 0xffff : 0xffffffff);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, e->second.ebo);
+            glDrawElements(mode, e->second.count, e->second.type, 0);
+        } else if (ebos.empty() && num_vertices > 0) {
             glDrawArrays(mode, 0, num_vertices);
         }
     }
 
 private:
+    // Wait for the draws submitted so far, before writing to a persistent mapping
+    static void finishDraws()
+    {
+        GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        while (glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(sync);
+    }
+
+    // Mapped storage of a buffer
+    struct Mapping {
+        void* ptr = nullptr;
+        GLsizeiptr size = 0;
+        bool persistent = false; // Mapped as long as the buffer exists
+    };
+
+    // Index buffer of a primitive mode
+    struct Elements {
+        GLuint ebo = 0;
+        GLsizei count = 0;
+        GLenum type = GL_UNSIGNED_INT;
+    };
+
     std::map<std::string,GLuint> attribs;
-    GLuint *vbo, ebo, vao;
+    std::map<GLenum, Elements> ebos;
+    uint64_t tag = 0;
+    GLuint *vbo, vao;
     GLuint num_vertices;
     int num_buffers;
+    std::vector<Mapping> mappings;
     inline static VertexArray* current=nullptr;
 };
\ No newline at end of file
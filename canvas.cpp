@@ -8,7 +8,12 @@
  */
 
 #include "canvas.h"
+#include "evaluation.hpp"
+#include <cstddef>
+#include <cstdlib>
+#include <filesystem>
 #include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
 
 using std::complex;
 using std::vector;
@@ -17,6 +22,140 @@ using std::max;
 using std::min;
 using std::string;
 
+// Progressive evaluation: levels of every 8th, 4th, 2nd and every grid point,
+// the coarsest one has at least MIN_CELLS cells per row
+static const int MAX_STRIDE = 8, MIN_CELLS = 16;
+
+// Memory of the tile cache, in MB, unless changed by setCacheSize
+static const int TILE_CACHE_MB = 256;
+
+// Grids evaluated faster are not written to the disk cache
+static const int DISK_CACHE_MIN_MS = 200;
+
+static int coarsestStride(int res)
+{
+    int stride = MAX_STRIDE;
+    while (stride > 1 && (res-1) / stride < MIN_CELLS)
+        stride /= 2;
+    return stride;
+}
+
+// Columns of row j that the level of stride adds: the ones not evaluated by the
+// coarser level (twice the stride), all points of the lattice for the coarsest
+static void levelColumns(int res, int j, int stride, bool coarsest, vector<int>& cols)
+{
+    cols.clear();
+    const bool coarseRow = !coarsest && j % (2*stride) == 0;
+    for (int i=0; i < res; i += stride)
+        if (!coarseRow || i % (2*stride))
+            cols.push_back(i);
+}
+
+// A pan by (panX, panY) grid steps adds point (i, j): it is in one of the rows
+// or columns the pan adds
+static bool panAdds(int res, int i, int j, int panX, int panY)
+{
+    return (panY > 0 ? j >= res - panY : j < -panY) || (panX > 0 ? i >= res - panX : i < -panX);
+}
+
+// Columns of row j that a pan adds
+static void panColumns(int res, int j, int panX, int panY, vector<int>& cols)
+{
+    cols.clear();
+    for (int i=0; i < res; ++i)
+        if (panAdds(res, i, j, panX, panY))
+            cols.push_back(i);
+}
+
+// Ranges of the ring buffer (see Job::slot) holding the points of panColumns
+static vector<VertexArray::Range> panRanges(int res, int offsetX, int offsetY, int panX, int panY)
+{
+    vector<VertexArray::Range> ranges;
+    const int first = panX > 0 ? res - panX : 0, count = std::abs(panX); // New columns
+    for (int j=0; j < res; ++j) {
+        const size_t row = (size_t)((j + offsetY) % res) * res;
+        if (panY > 0 ? j >= res - panY : j < -panY) {
+            ranges.push_back({ row, (size_t)res });
+        } else if (count) {
+            const int start = (first + offsetX) % res, head = min(count, res - start); // Up to the end of the row
+            ranges.push_back({ row + start, (size_t)head });
+            if (head < count)
+                ranges.push_back({ row, (size_t)(count - head) });
+        }
+    }
+    return ranges;
+}
+
+// Index of each point of a grid of res points on center +- length in a grid
+// of oldRes points on oldCenter +- oldLength, -1 if none coincides (up to a
+// small fraction of the step). Returns the number of points found.
+static int matchGrid(int res, float center, float length, int oldRes, float oldCenter, float oldLength, vector<int>& index)
+{
+    index.assign(res, -1);
+    if (oldRes < 2)
+        return 0;
+
+    int found = 0;
+    for (int i=0; i < res; ++i) {
+        const double x = center + length * (2.0 * i / (res-1) - 1.0);
+        const double k = ((x - oldCenter) / oldLength + 1.0) * (oldRes-1) / 2.0;
+        const double r = std::round(k);
+        if (std::abs(k - r) < 1e-3 && r >= 0 && r < oldRes) {
+            index[i] = r;
+            ++found;
+        }
+    }
+    return found;
+}
+
+// Remove the columns the cache has (see matchGrid) from cols, if it has the
+// row. copy(i, k) takes column i from column k of the cache.
+template <class F>
+static void takeCached(const vector<int>& columns, int row, vector<int>& cols, F copy)
+{
+    if (row < 0)
+        return;
+    cols.erase(std::remove_if(cols.begin(), cols.end(), [&](int i) {
+        if (columns[i] < 0)
+            return false;
+        copy(i, columns[i]);
+        return true;
+    }), cols.end());
+}
+
+// Remove the columns of row j copied from the tiles from cols
+static void takeTiled(const vector<uint8_t>& tiled, int res, int j, vector<int>& cols)
+{
+    cols.erase(std::remove_if(cols.begin(), cols.end(), [&](int i) {
+        return tiled[i + (size_t)j * res];
+    }), cols.end());
+}
+
+// Directory of the disk cache, $XDG_CACHE_HOME/holomplot or ~/.cache/holomplot,
+// created if needed. Empty if there is none.
+static string gridDirectory()
+{
+    namespace fs = std::filesystem;
+    const char *cache = std::getenv("XDG_CACHE_HOME"), *home = std::getenv("HOME");
+    fs::path dir;
+    if (cache && *cache)
+        dir = cache;
+    else if (home && *home)
+        dir = fs::path(home) / ".cache";
+    else
+        return "";
+    dir /= "holomplot";
+    std::error_code error;
+    fs::create_directories(dir, error);
+    return error ? "" : dir.string();
+}
+
+// Attributes of GraphVertex
+static const vector<VertexArray::Attribute> graphLayout = {
+    { "vPos", 4, offsetof(GraphVertex, pos) },
+    { "vNorm", 4, offsetof(GraphVertex, norm) },
+};
+
 // Creates a monochrome bitmap from a text
 static unsigned char* renderText(const wxString& text, const wxFont& font, int* width, int* height)
 {
@@ -53,13 +192,24 @@ Canvas::Canvas(mainFrame* parent, const wxGLAttributes& canvasAttrs)
     parent(parent),
     graphShader("graph_vertex.glsl", "graph_frag.glsl"),
     labelShader("label_vertex.glsl", "label_frag.glsl"),
+    gpuShader("graph_vertex.glsl", "graph_frag.glsl"),
+    heightShader("graph_vertex.glsl", "graph_frag.glsl"),
+    ringShader("graph_vertex.glsl", "graph_frag.glsl"),
+    ringTexels(0),
     scr_h(0),
     scr_w(0),
     resolution(50),
     needsRecalc(false),
     isInitialized(false),
     imagWorld(false),
-    graphStyle(gsFillGrid)
+    gpuStale(true),
+    graphStyle(gsFillGrid),
+    evalMode(emVertices),
+    tiles((size_t)TILE_CACHE_MB << 20),
+    gridDir(gridDirectory()),
+    front(0),
+    jobCancel(false),
+    jobStride(0)
 {
 
     reset();
@@ -80,6 +230,9 @@ Canvas::Canvas(mainFrame* parent, const wxGLAttributes& canvasAttrs)
 
 Canvas::~Canvas()
 {
+    cancelJob();
+    if (saver.joinable())
+        saver.join();
     delete oglCtx;
 }
 
@@ -104,7 +257,14 @@ void Canvas::initGL()
 
     graphShader.init();
     labelShader.init();
-    graph.init();
+    heightShader.init("#define HEIGHTFIELD\n");
+    ringShader.init("#define RING_BUFFER\n");
+    graph[0].init();
+    graph[1].init();
+    gridGraph.init();
+    heightfield.init();
+    ringVertices.init();
+    glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &ringTexels);
     axis.init();
     label.init();
 
@@ -144,14 +304,27 @@ void Canvas::refreshCam()
 // Clear the plot and move the cam to initial position
 void Canvas::reset()
 {
+    cancelJob();
     theta = 0.7f;
     rho = -1.8f;
     camDist = 15.0f;
     axisLength = 10.0f;
+    centerX = centerY = 0.0f;
+    panRestX = panRestY = 0.0f;
     exprStr = "0";
+    exprHash = GridFile::hash(exprStr);
     expr = Expr<complex<double> >();
+    program = Program<complex<double> >();
+    jit.reset();
+    valueProgram = Program<complex<double> >();
+    valueJit.reset();
+    gpuCode = "";
+    gpuStale = true;
     needsRecalc = true;
-    graph.clear();
+    graph[0].clear();
+    graph[1].clear();
+    cache.grid.resolution = 0;
+    drawn.resolution = 0; // Nothing to draw
     refreshCam();
 }
 
@@ -160,9 +333,6 @@ void Canvas::OnMouse(wxMouseEvent& event)
 {
     event.Skip();
 
-    if (isBusy)
-        return;
-
     if (event.LeftIsDown()) {
         wxPoint newPos = event.GetPosition();
         if (!event.Dragging()) {
@@ -180,6 +350,37 @@ void Canvas::OnMouse(wxMouseEvent& event)
         wxLogMessage("Cam @ radius=%.4g, theta=%.3g, rho=%.3g.", camDist, theta, rho);
     }
 
+    // Pan the plotted domain by whole grid steps, so the drawn grid can be shifted
+    if (event.RightIsDown()) {
+        wxPoint newPos = event.GetPosition();
+        if (!event.Dragging()) {
+            dragPos = newPos;
+        } else {
+            // Units of the plane per pixel at the origin's distance, the screen's
+            // x axis is (-sin(rho), cos(rho)) on the plane and its y axis points to the camera
+            const float scale = 2.0f * camDist * tan(glm::radians(22.5f)) * GetContentScaleFactor() / max(1, scr_h);
+            const float dx = (newPos.x - dragPos.x) * scale, dy = (newPos.y - dragPos.y) * scale;
+            panRestX += dx * sin(rho) - dy * cos(rho);
+            panRestY -= dx * cos(rho) + dy * sin(rho);
+            dragPos = newPos;
+
+            const float step = 2.0f * axisLength / (resolution - 1);
+            const float stepsX = std::trunc(panRestX / step), stepsY = std::trunc(panRestY / step);
+            if (stepsX || stepsY) {
+                centerX += stepsX * step;
+                centerY += stepsY * step;
+                panRestX -= stepsX * step;
+                panRestY -= stepsY * step;
+                needsRecalc = true;
+                Refresh(false);
+            }
+        }
+    }
+
+    if (event.RightUp()) {
+        wxLogMessage("Center @ %.4g%+.4gi.", centerX, centerY);
+    }
+
     const int maxRotation = 50;
     int rotation = max(-maxRotation, min(event.GetWheelRotation(), maxRotation));
 
@@ -216,58 +417,88 @@ void Canvas::OnPaint(wxPaintEvent &WXUNUSED(event))
     glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
+    // Swap in a finished evaluation, or start a new one. The GPU computes
+    // the vertices from the indices at each draw, after compiling the shader
+    // for a new expression.
+    if (jobStride)
+        finishJob();
+
     if (needsRecalc) {
         needsRecalc = false;
 
-        auto start = std::chrono::high_resolution_clock::now();
-
-        calcGraph();
-
-        // Compute duration in microseconds
-        auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - start);
-        wxLogMessage("------");
-        wxLogMessage("Evaluated f(z)=%s.", exprStr);
-        wxLogMessage("Processed %d evaluations.", resolution * resolution);
-        wxLogMessage("Time elapsed: %d us.", (int)duration.count());
+        if (evalMode == emGpu && !gpuCode.empty() && gpuStale) {
+            gpuShader.init("#define EVAL_ON_GPU\n" + Glsl<complex<double> >::library + gpuCode);
+            gpuStale = false;
+        }
+        startJob();
     }
 
-    graphShader.use();
-    graph.use();
-
-    // Light decay
-    float dist = camDist + axisLength; // Far away
-    graphShader.uniform("fLinear", 1.0f / dist);
-    graphShader.uniform("fQuadratic", 1.0f / (dist * dist));
-
-    // Graph color, my position, static color off, imaginary z axis
-    graphShader.uniform("fColor", glm::vec3(1.0f, 0.0f, 0.0f));
-    graphShader.uniform("camPos", camPos);
-    graphShader.uniform("axisLength", axisLength);
-    graphShader.uniform("staticColor", glm::vec3(0.0f, 0.0f, 0.0f));
-    graphShader.uniform("staticColorMix", 0.0f);
-    graphShader.uniform("zIsImag", (int)imagWorld);
-
-    // z value of the (not normalized) normals
-    float resStep = 2.0f * axisLength / (resolution-1);
-    graphShader.uniform("normZ", resStep * resStep);
-
     // MVP Matrices
     auto proj = glm::perspective(glm::radians(45.0f), (float)scr_w / scr_h, camDist * 0.01f, 5.0f * (axisLength + camDist));
     auto view = glm::lookAt(camPos, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f));
-    graphShader.uniform("model", glm::mat4(1.0f)); // Static model
-    graphShader.uniform("normal", glm::mat3(1.0f));
-    graphShader.uniform("proj", proj);
-    graphShader.uniform("view", view);
+    auto model = glm::translate(glm::mat4(1.0f), glm::vec3(-centerX, -centerY, 0.0f)); // Center of the domain to the origin
+
+    // Uniforms shared by the graph shaders
+    auto setUniforms = [&](const Shader& shader) {
+        shader.use();
+
+        // Light decay
+        float dist = camDist + axisLength; // Far away
+        shader.uniform("fLinear", 1.0f / dist);
+        shader.uniform("fQuadratic", 1.0f / (dist * dist));
+
+        // Graph color, my position, static color off, imaginary z axis
+        shader.uniform("fColor", glm::vec3(1.0f, 0.0f, 0.0f));
+        shader.uniform("camPos", camPos);
+        shader.uniform("axisLength", axisLength);
+        shader.uniform("staticColor", glm::vec3(0.0f, 0.0f, 0.0f));
+        shader.uniform("staticColorMix", 0.0f);
+        shader.uniform("zIsImag", (int)imagWorld);
+
+        // z value of the (not normalized) normals
+        shader.uniform("normZ", 1.0f);
+
+        shader.uniform("model", model);
+        shader.uniform("normal", glm::mat3(1.0f));
+        shader.uniform("proj", proj);
+        shader.uniform("view", view);
+    };
+    setUniforms(graphShader);
+
+    // The surface from the CPU's vertices (triangles of the adaptive mesh, or
+    // read from their ring buffer by ringShader), or computed from the grid
+    // indices by gpuShader or heightShader
+    const bool cpuVertices = drawn.mode == emVertices || drawn.mode == emAdaptive;
+    const bool ring = drawn.mode == emVertices && drawsRing(drawn.resolution);
+    const Shader& surfaceShader = drawn.mode == emGpu ? gpuShader : drawn.mode == emHeightfield ? heightShader
+                                  : ring ? ringShader : graphShader;
+    VertexArray& surface = cpuVertices ? graph[front] : gridGraph;
+    if (!cpuVertices) {
+        setUniforms(surfaceShader);
+        surfaceShader.uniform("resolution", drawn.resolution);
+        surfaceShader.uniform("gridLength", drawn.axisLength);
+        surfaceShader.uniform("gridCenter", glm::vec2(drawn.centerX, drawn.centerY));
+    }
+    if (ring) {
+        setUniforms(ringShader);
+        ringShader.uniform("resolution", drawn.resolution);
+        ringShader.uniform("gridOffset", glm::ivec2(drawn.offsetX, drawn.offsetY));
+        ringVertices.use(ringShader, "vertices");
+    }
+    if (drawn.mode == emHeightfield) {
+        heightfield.use(heightShader, "values");
+        heightShader.uniform("gridStride", drawn.stride);
+    }
 
     // Surface
-    if (graphStyle == gsFill || graphStyle == gsFillGrid) {
-        graph.draw();
-        graphShader.uniform("staticColorMix", 1.0f);
+    if (drawn.resolution && (graphStyle == gsFill || graphStyle == gsFillGrid)) {
+        surface.draw(drawn.mode == emAdaptive ? GL_TRIANGLES : GL_TRIANGLE_STRIP);
+        surfaceShader.uniform("staticColorMix", 1.0f);
     }
 
     // Grid
-    if (graphStyle == gsGrid || graphStyle == gsFillGrid) {
-        graph.draw(GL_LINES);
+    if (drawn.resolution && (graphStyle == gsGrid || graphStyle == gsFillGrid)) {
+        surface.draw(GL_LINES);
     }
 
     // Labels
@@ -279,14 +510,14 @@ void Canvas::OnPaint(wxPaintEvent &WXUNUSED(event))
     labelShader.uniform("proj", proj);
     labelShader.uniform("view", view);
 
-    auto pos = proj * view * glm::vec4(labelUnit, 0.0f, 0.0f, 1.0f);
+    auto pos = proj * view * model * glm::vec4(labelUnit, 0.0f, 0.0f, 1.0f);
     glm::vec2 translate(pos / pos.z);
     glm::vec2 shift(translate.x * labelCX, translate.y * labelCY);
     labelX.use(labelShader);
     labelShader.uniform("translate", translate + shift);
     label.draw(GL_TRIANGLES);
 
-    pos = proj * view * glm::vec4(0.0f, labelUnit, 0.0f, 1.0f);
+    pos = proj * view * model * glm::vec4(0.0f, labelUnit, 0.0f, 1.0f);
     translate = glm::vec2(pos / pos.z);
     shift = glm::vec2(translate.x * labelCX, translate.y * labelCY);
     labelY.use(labelShader);
@@ -311,16 +542,25 @@ void Canvas::OnPaint(wxPaintEvent &WXUNUSED(event))
     SwapBuffers();
 }
 
-// Change resolution, refill indices array and create new axis labels
+// Change resolution, the next evaluation uses it
 void Canvas::setResolution(int res)
 {
     if (res)
         resolution = res+1;
 
-    if (!isInitialized)
-        return;
+    needsRecalc = true;
+    Refresh(false);
+}
 
-    setupIndices();
+// Change the memory of the tile cache, least recently used tiles are dropped
+void Canvas::setCacheSize(int megabytes)
+{
+    tiles.setBudget((size_t)max(0, megabytes) << 20);
+}
+
+int Canvas::getCacheSize()
+{
+    return tiles.budget() >> 20;
 }
 
 void Canvas::setupLabels()
@@ -387,46 +627,49 @@ void Canvas::setupLabels()
     axis.buffer(buf, graphShader);
 }
 
-// Fill up the elements buffer
-void Canvas::setupIndices()
-{
-    // Indices to draw
-    auto idx = [&](int i, int j) { return i + j*resolution; };
-    vector<int> indices;
-    for (int j=0; j < resolution-1; ++j) {
-        for (int i=0; i < resolution-1; ++i) {
-            indices.push_back(idx(i, j));
-            indices.push_back(idx(i+1, j));
-            indices.push_back(idx(i, j+1));
-
-            indices.push_back(idx(i, j+1));
-            indices.push_back(idx(i+1, j));
-            indices.push_back(idx(i+1, j+1));
-        }
-    }
-
-    graph.elements(indices);
-    needsRecalc = true;
-}
-
 // Receive a new expression to plot
 void Canvas::setExpression(const string& str)
 {
     Expr<complex<double> > newExpr(str);
 
-    // Test expression (all variables assigned?),
+    // Bind variables (all variables assigned?),
     // throws invalid_argument if not.
-    newExpr({
-        {"x", complex<double>(0.0)},
-        {"y", complex<double>(0.0)},
-        {"z", complex<double>(0.0)},
-        {"i", complex<double>(0.0, 1.0)},
-        {"e", complex<double>(M_E, 0.0)},
-        {"pi", complex<double>(M_PI, 0.0)},
-    });
-
-    expr = newExpr;
+    newExpr.bind(exprVars, exprConsts);
+    // Throws invalid_argument too if a function has no derivative.
+    Program<complex<double> > newProgram(newExpr, exprRealVars, exprGradients);
+    Program<complex<double> > newValueProgram(newExpr, exprRealVars);
+
+    // GLSL version for the GPU, if all functions have one
+    try {
+        Glsl<complex<double> > glsl(newExpr, glslSignature, glslVars);
+        gpuCode = glsl.code();
+        gpuLines = glsl.lines();
+    } catch (const std::invalid_argument&) {
+        gpuCode = "";
+    }
+    gpuStale = true;
+
+    // The running evaluation uses the programs
+    cancelJob();
+    expr = std::move(newExpr);
+    program = newProgram;
+    valueProgram = newValueProgram;
+    cache.grid.resolution = 0;
+
+    // Translate to native code where possible, calcGraph uses the interpreter otherwise
+    auto translate = [](const Program<complex<double> >& p) {
+        std::unique_ptr<Jit> native;
+        if (Jit::available()) {
+            native = std::make_unique<Jit>(p);
+            if (!native->compiled())
+                native.reset();
+        }
+        return native;
+    };
+    jit = translate(program);
+    valueJit = translate(valueProgram);
     exprStr = str;
+    exprHash = GridFile::hash(str);
     needsRecalc = true;
     Refresh(false);
 }
@@ -438,6 +681,14 @@ void Canvas::setGraphStyle(GraphStyle gs)
     Refresh(false);
 }
 
+// Evaluation: CPU vertices / CPU adaptive / CPU heightfield / GPU
+void Canvas::setEvalMode(EvalMode mode)
+{
+    evalMode = mode;
+    needsRecalc = true;
+    Refresh(false);
+}
+
 // Imaginary z-Axis on/off
 void Canvas::setGraphImag(bool imag)
 {
@@ -445,74 +696,517 @@ void Canvas::setGraphImag(bool imag)
     Refresh(false);
 }
 
-// Fill up the graph VertexArray and calculate normals
-void Canvas::calcGraph()
+// Start the evaluation for the current settings: a worker thread evaluates on
+// the CPU, into the back buffer, level by level from a coarse grid to the full
+// resolution. The adaptive mesh is drawn when complete. The GPU evaluates at
+// each draw, nothing to wait for.
+void Canvas::startJob()
 {
-    isBusy = true; // Lock mouse events
+    cancelJob();
+
+    job = Job();
+    job.mode = evalMode;
+    job.resolution = resolution;
+    job.axisLength = axisLength;
+    job.centerX = centerX;
+    job.centerY = centerY;
+    job.buffer = 1 - front;
+    job.points = resolution * resolution;
+    job.tileGrid = TileCache<GraphVertex>::grid(exprHash, resolution, centerX, centerY, axisLength);
+    job.start = std::chrono::high_resolution_clock::now();
+    if ((job.mode == emGpu && (gpuCode.empty() || !gpuShader.ok())) || (job.mode == emHeightfield && !heightShader.ok()))
+        job.mode = emVertices;
+
+    if (job.mode == emGpu) {
+        jobStride = 1;
+        finishJob();
+        return;
+    }
 
-    map<string,vector<vector<float> > > buf;
-    buf["vPos"] = vector<vector<float> >(resolution * resolution);
-    buf["vNorm"] = vector<vector<float> >(resolution * resolution);
-
-    // Evaluate function using parallel processing
-    tbb::parallel_for(size_t(0), buf["vPos"].size(), [&](size_t index) {
-        float x = -axisLength + 2.0f * (index % resolution) * axisLength / (resolution-1);
-        float y = -axisLength + 2.0f * (index / resolution) * axisLength / (resolution-1);
-
-        complex<double> z = expr({
-            {"x", complex<double>(x)},
-            {"y", complex<double>(y)},
-            {"z", complex<double>(x, y)},
-            {"i", complex<double>(0.0, 1.0)},
-            {"e", complex<double>(M_E, 0.0)},
-            {"pi", complex<double>(M_PI, 0.0)},
+    if (startPan() || loadGrid())
+        return;
+
+    const Job j = job;
+    if (job.mode == emAdaptive) {
+        worker = std::thread([this, j] {
+            // Values and derivatives at the points (relative to the center), like calcGraph
+            auto eval = [this, j](int n, const double* xs, const double* ys, double* re, double* im) {
+                vector<double> x(n), y(n);
+                for (int k=0; k < n; ++k) {
+                    x[k] = j.centerX + xs[k];
+                    y[k] = j.centerY + ys[k];
+                }
+                evalPoints(program, jit.get(), n, x.data(), y.data(), re, im);
+            };
+            auto result = std::make_unique<AdaptiveMesh>(j.axisLength, j.resolution, (size_t)j.points, eval, &jobCancel);
+            if (!result->complete())
+                return;
+            mesh = std::move(result);
+            jobStride = 1;
+            CallAfter([this] { Refresh(false); });
         });
-        // Real and complex part of the function value goes to the shader
-        buf["vPos"][index] = { x, y, (float)z.real(), (float)z.imag() };
+        return;
+    }
+
+    // The worker writes into the mapped buffer, OnPaint draws the front one meanwhile
+    GraphVertex* vertices = nullptr;
+    if (job.mode == emVertices) {
+        vertices = graph[j.buffer].map<GraphVertex>(j.resolution * j.resolution, graphLayout, graphShader);
+        if (!vertices) {
+            wxLogMessage("The vertex buffer can not be mapped.");
+            return;
+        }
+    } else {
+        heightValues.resize(2 * j.resolution * j.resolution);
+    }
+
+    // The points shared with the last evaluation are copied from the cache
+    const Job& g = cache.grid;
+    const int oldRes = g.mode == j.mode ? g.resolution : 0;
+    const int columns = matchGrid(j.resolution, j.centerX, j.axisLength, oldRes, g.centerX, g.axisLength, cacheColumns);
+    const int rows = matchGrid(j.resolution, j.centerY, j.axisLength, oldRes, g.centerY, g.axisLength, cacheRows);
+    job.reused = columns * rows;
+    job.points -= job.reused;
+    takeTiles(vertices);
+
+    worker = std::thread([this, j, vertices] {
+        const int coarsest = coarsestStride(j.resolution);
+        for (int stride = coarsest; stride >= 1; stride /= 2) {
+            bool ok = vertices ? calcGraph(vertices, j, stride, stride == coarsest)
+                               : calcHeightfield(heightValues.data(), j, stride, stride == coarsest);
+            if (!ok)
+                return;
+
+            // The next level writes to heightValues while OnPaint uploads this one
+            if (!vertices && stride > 1) {
+                std::lock_guard<std::mutex> lock(heightMutex);
+                heightStaged = heightValues;
+            }
+            jobStride = stride;
+            CallAfter([this] { Refresh(false); });
+        }
     });
+}
 
-    // Normals:
+// Shift the drawn grid to the new center, if it moved by whole grid steps:
+// the points both grids have stay in their slots of the ring buffer (in
+// graph[front] and the cache), the worker evaluates the rows and columns
+// the pan adds. ringShader draws the buffer from its new offsets, the indices
+// stay. Returns false for a new grid.
+bool Canvas::startPan()
+{
+    const Job& g = cache.grid;
+    const int res = job.resolution;
+    const bool same = drawsRing(res) && g.mode == emVertices && drawn.mode == emVertices && drawn.stride == 1 && job.mode == emVertices
+                      && g.resolution == res && drawn.resolution == res && g.axisLength == job.axisLength
+                      && drawn.axisLength == g.axisLength && drawn.centerX == g.centerX && drawn.centerY == g.centerY;
+    if (!same)
+        return false;
+
+    const float step = 2.0f * job.axisLength / (res - 1);
+    const float stepsX = (job.centerX - g.centerX) / step, stepsY = (job.centerY - g.centerY) / step;
+    const int panX = std::round(stepsX), panY = std::round(stepsY);
+    if (std::abs(stepsX - panX) > 1e-3f || std::abs(stepsY - panY) > 1e-3f || (!panX && !panY)
+        || std::abs(panX) >= res || std::abs(panY) >= res)
+        return false;
+
+    job.panX = panX;
+    job.panY = panY;
+    job.offsetX = ((g.offsetX + panX) % res + res) % res;
+    job.offsetY = ((g.offsetY + panY) % res + res) % res;
+    job.buffer = front;
+    job.reused = (res - std::abs(panX)) * (res - std::abs(panY));
+    job.points -= job.reused;
+
+    graphSamples.resize(res * res);
+    takeTiles(graphSamples.data());
+    const Job j = job;
+    worker = std::thread([this, j] {
+        if (!calcGraph(graphSamples.data(), j, 1, true))
+            return;
+        storeTiles(j, graphSamples.data(), nullptr);
+        jobStride = 1;
+        CallAfter([this] { Refresh(false); });
+    });
+    return true;
+}
 
-    // Get vPos at index as vec4
-    auto getVec = [&](int index) {
-        return glm::vec4(buf["vPos"][index][0], buf["vPos"][index][1], buf["vPos"][index][2], buf["vPos"][index][3]);
-    };
+// The graph of emVertices is drawn by ringShader, if it compiles and the
+// vertices fit in a buffer texture. Else the grid is not shifted in its ring
+// buffer (offsets 0), graphShader draws it from the vertex attributes.
+bool Canvas::drawsRing(int resolution) const
+{
+    return ringShader.ok() && 2 * (long)resolution * resolution <= ringTexels;
+}
+
+// Copy the points of the job's grid that tiles has and the cache has not (or
+// that a pan adds), to vertices (or to heightValues if nullptr), and mark them
+// in fromTiles
+void Canvas::takeTiles(GraphVertex* vertices)
+{
+    const int res = job.resolution;
+    const float length = job.axisLength;
+    const bool pan = job.panX || job.panY;
+    fromTiles.assign((size_t)res * res, 0);
 
-    // Simultaenous "cross products" for the first two components of normals at (x,y,re(z)) and (x,y,im(z))
-    auto cross = [&](const glm::vec4& a, const glm::vec4& b, const glm::vec4& c) {
-        glm::vec4 d = a-c, e = b-c;
-        return glm::vec4(d.y * e.z - d.z * e.y, d.z * e.x - d.x * e.z, d.y * e.w - d.w * e.y, d.w * e.x - d.x * e.w);
+    auto wanted = [&](int i, int j) {
+        return pan ? panAdds(res, i, j, job.panX, job.panY) : cacheColumns[i] < 0 || cacheRows[j] < 0;
+    };
+    auto take = [&](int i, int j, const GraphVertex& s) {
+        fromTiles[i + (size_t)j * res] = 1;
+        if (job.mode == emHeightfield) {
+            heightValues[2 * (i + (size_t)j * res)] = s.pos[2];
+            heightValues[2 * (i + (size_t)j * res) + 1] = s.pos[3];
+            return;
+        }
+        // At the coordinates calcGraph computes
+        GraphVertex v = s;
+        v.pos[0] = gridPoint(job.centerX, length, res, i);
+        v.pos[1] = gridPoint(job.centerY, length, res, j);
+        vertices[job.slot(i, j)] = v;
     };
 
-    // Calculate normals using parallel processing
-    tbb::parallel_for(size_t(0), buf["vNorm"].size(), [&](size_t index) {
-        int i = index % resolution, j = index / resolution;
-
-        glm::vec4 me(getVec(index));
-        glm::vec4 left, top, bottom, right, norm(0.0f);
-
-        if (i > 0)
-            left = glm::vec4(getVec(index-1));
-        if (j > 0)
-            top = glm::vec4(getVec(index-resolution));
-        if (i < resolution-1)
-            right = glm::vec4(getVec(index+1));
-        if (j < resolution-1)
-            bottom = glm::vec4(getVec(index+resolution));
-
-        int k=0;
-        if (i>0 && j>0) { norm = cross(left, top, me); ++k; }
-        if (i>0 && j<resolution-1) { norm += cross(bottom, left, me); ++k; }
-        if (i<resolution-1 && j>0) { norm += cross(top, right, me); ++k; }
-        if (i<resolution-1 && j<resolution-1) { norm += cross(right, bottom, me); ++k; }
-        norm /= (float)k;
-        // First two components of normals at (x,y,re(z)) and (x,y,im(z)). Third is uniform normZ.
-        buf["vNorm"][index] = { norm.x, norm.y, norm.z, norm.w };
+    using Tiles = TileCache<GraphVertex>;
+    const uint8_t content = job.mode == emHeightfield ? Tiles::VALUE : Tiles::VALUE | Tiles::NORMAL;
+    job.tiled = tiles.lookup(job.tileGrid, content, wanted, take);
+    job.points -= job.tiled;
+}
+
+// Store the points of the job's grid in tiles: its vertices at the slots of
+// the ring buffer (only the ones a pan adds), or the values of emHeightfield.
+// Runs on the worker thread, or on saver.
+void Canvas::storeTiles(const Job& job, const GraphVertex* vertices, const float* values)
+{
+    using Tiles = TileCache<GraphVertex>;
+    const int res = job.resolution;
+    if (job.mode == emHeightfield) {
+        tiles.store(job.tileGrid, Tiles::VALUE, [&](int i, int j, GraphVertex& s) {
+            const float* value = values + 2 * (i + (size_t)j * res);
+            s = { { 0.0f, 0.0f, value[0], value[1] }, {} };
+            return true;
+        });
+        return;
+    }
+    const bool pan = job.panX || job.panY;
+    tiles.store(job.tileGrid, Tiles::VALUE | Tiles::NORMAL, [&](int i, int j, GraphVertex& s) {
+        if (pan && !panAdds(res, i, j, job.panX, job.panY))
+            return false; // In the cache, stored with its grid
+        s = vertices[job.slot(i, j)];
+        return true;
     });
+}
 
-    graph.buffer(buf, graphShader);
+// Grid of the job in the disk cache, for emVertices with the normals
+GridFile::Header Canvas::gridHeader(const Job& job) const
+{
+    GridFile::Header header;
+    header.flags = job.mode == emVertices ? GridFile::NORMALS : 0;
+    header.expr = exprHash;
+    header.centerX = job.centerX;
+    header.centerY = job.centerY;
+    header.axisLength = job.axisLength;
+    header.resolution = job.resolution;
+    return header;
+}
+
+// File of the job's grid, the same for both modes
+string Canvas::gridPath(const Job& job) const
+{
+    GridFile::Header header = gridHeader(job);
+    header.flags = 0;
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.grid", (unsigned long long)GridFile::hash(string((const char*)&header, sizeof(header))));
+    return gridDir + "/" + name;
+}
 
-    setupLabels();
+// Read the job's grid from the disk cache, if it has it: the mapped file is
+// copied into the buffer the worker would write (the mapped vertex buffer
+// or heightValues) and swapped in at once. Returns false to evaluate it.
+bool Canvas::loadGrid()
+{
+    if (gridDir.empty() || (job.mode != emVertices && job.mode != emHeightfield))
+        return false;
+    const GridFile file(gridPath(job));
+    if (!file.ok() || !file.header().covers(gridHeader(job)))
+        return false;
+
+    const int res = job.resolution;
+    const float length = job.axisLength;
+    const float* values = file.values();
+    if (job.mode == emHeightfield) {
+        heightValues.assign(values, values + 2 * (size_t)res * res);
+    } else {
+        GraphVertex* vertices = graph[job.buffer].map<GraphVertex>(res * res, graphLayout, graphShader);
+        if (!vertices)
+            return false;
+        const float* normals = file.normals();
+        tbb::parallel_for(tbb::blocked_range<int>(0, res), [&](const tbb::blocked_range<int>& rows) {
+            for (int j=rows.begin(); j != rows.end(); ++j) {
+                const float y = gridPoint(job.centerY, length, res, j);
+                for (int i=0; i < res; ++i) {
+                    const size_t k = i + (size_t)j * res;
+                    const float *value = values + 2 * k, *n = normals + 4 * k;
+                    vertices[k] = { { gridPoint(job.centerX, length, res, i), y, value[0], value[1] },
+                                    { n[0], n[1], n[2], n[3] } };
+                }
+            }
+        });
+    }
 
-    isBusy = false; // Unlock mouse events
-}
\ No newline at end of file
+    job.loaded = job.points;
+    job.points = 0;
+    jobStride = 1;
+    finishJob();
+    return true;
+}
+
+// Store the grid of the cache in tiles, and write it to the disk cache if it
+// took long enough to evaluate, once it is swapped in. saver reads the samples it
+// shares with the cache, whatever the next evaluation does meanwhile.
+void Canvas::saveGrid()
+{
+    if (saver.joinable())
+        saver.join();
+
+    const Job j = cache.grid;
+    const auto elapsed = std::chrono::high_resolution_clock::now() - j.start;
+    const bool save = !gridDir.empty() && elapsed >= std::chrono::milliseconds(DISK_CACHE_MIN_MS);
+    const GridFile::Header header = gridHeader(j);
+    const string path = save ? gridPath(j) : "";
+    saver = std::thread([this, j, header, path, vertices = cache.vertices, values = cache.values] {
+        if (j.mode == emHeightfield) {
+            storeTiles(j, nullptr, values->data());
+            if (!path.empty())
+                GridFile::write(path, header, values->data(), nullptr);
+            return;
+        }
+        // The values and normals are written from the vertices, in the order of the grid (no pan)
+        const GraphVertex* v = vertices->data();
+        storeTiles(j, v, nullptr);
+        if (!path.empty())
+            GridFile::write(path, header, v->pos + 2, v->norm, false, sizeof(GraphVertex) / sizeof(float));
+    });
+}
+
+// Stop the worker, the back buffer stays mapped for the next evaluation
+void Canvas::cancelJob()
+{
+    if (worker.joinable()) {
+        jobCancel = true;
+        worker.join();
+        jobCancel = false;
+    }
+    jobStride = 0;
+    mesh.reset();
+}
+
+// Swap in the latest level of the evaluation. The back buffer becomes the
+// front one, coarser levels are drawn from it while the worker still writes
+// the finer ones (if it is mapped persistently, else only the last level).
+void Canvas::finishJob()
+{
+    const int stride = jobStride.exchange(0);
+    if (stride == 1 && worker.joinable())
+        worker.join();
+
+    if (job.mode == emVertices) {
+        VertexArray& back = graph[job.buffer];
+        if (stride > 1 && !back.persistent())
+            return;
+        if (stride == 1 && !back.unmap()) {
+            needsRecalc = true; // Lost while mapped, evaluate again
+            return;
+        }
+        front = job.buffer;
+        ringVertices.buffer(back.vertexBuffer());
+        GridTopology::get(job.resolution, stride).upload(back);
+        if (job.panX || job.panY) {
+            // Only the points the pan adds, in the drawn buffer and the cache
+            const auto ranges = panRanges(job.resolution, job.offsetX, job.offsetY, job.panX, job.panY);
+            back.update(ranges, graphSamples.data());
+            if (cache.vertices.use_count() > 1) // Still read by saver
+                cache.vertices = std::make_shared<vector<GraphVertex> >(*cache.vertices);
+            for (const auto& r : ranges)
+                std::copy_n(graphSamples.begin() + r.first, r.count, cache.vertices->begin() + r.first);
+        } else if (stride == 1) {
+            // The vertices were only written to the buffer, read back once for the cache
+            auto vertices = std::make_shared<vector<GraphVertex> >((size_t)job.resolution * job.resolution);
+            back.read(vertices->size(), vertices->data());
+            cache.vertices = vertices;
+        }
+    } else if (job.mode == emAdaptive) {
+        // The vertices of the mesh, finished by the worker
+        VertexArray& back = graph[job.buffer];
+        const auto& samples = mesh->samples();
+        GraphVertex* vertices = back.map<GraphVertex>(samples.size(), graphLayout, graphShader);
+        if (!vertices) {
+            wxLogMessage("The vertex buffer can not be mapped.");
+            return;
+        }
+        for (size_t k=0; k < samples.size(); ++k) {
+            const auto& p = samples[k];
+            vertices[k] = { { (float)(job.centerX + p.x), (float)(job.centerY + p.y), (float)p.value.real(), (float)p.value.imag() },
+                            { slope(p.dx.real()), slope(p.dy.real()), slope(p.dx.imag()), slope(p.dy.imag()) } };
+        }
+        if (!back.unmap()) {
+            needsRecalc = true;
+            return;
+        }
+        back.elements(mesh->triangles(), GL_TRIANGLES);
+        back.elements(mesh->lines(), GL_LINES);
+        front = job.buffer;
+        job.points = samples.size();
+        mesh.reset();
+    } else {
+        if (job.mode == emHeightfield) {
+            std::lock_guard<std::mutex> lock(heightMutex);
+            const vector<float>& values = stride > 1 ? heightStaged : heightValues;
+            heightfield.buffer(values.data(), job.resolution, job.resolution);
+            if (stride == 1)
+                cache.values = std::make_shared<vector<float> >(std::move(heightValues));
+        }
+        GridTopology::get(job.resolution, stride).upload(gridGraph);
+    }
+
+    // A complete grid is cached for the next evaluation, and stored once drawn
+    if (stride == 1 && (job.mode == emVertices || job.mode == emHeightfield)) {
+        cache.grid = job;
+        if (!job.panX && !job.panY && !job.loaded)
+            saveGrid();
+    }
+
+    if (drawn.resolution != job.resolution || drawn.axisLength != job.axisLength)
+        setupLabels();
+    drawn = job;
+    drawn.stride = stride;
+    logJob();
+}
+
+void Canvas::logJob()
+{
+    // Compute duration in microseconds
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - drawn.start);
+    if (drawn.stride > 1) {
+        wxLogMessage("Drew 1/%d of the resolution after %d us.", drawn.stride, (int)duration.count());
+        return;
+    }
+
+    const int points = drawn.points;
+    wxLogMessage("------");
+    wxLogMessage("Evaluated f(z)=%s.", exprStr);
+    wxLogMessage("Processed %d evaluations.", points);
+    if (drawn.mode == emAdaptive)
+        wxLogMessage("Refined the mesh to %d%% of the grid's points.", (int)(100.0 * points / (drawn.resolution * drawn.resolution)));
+    if (drawn.loaded)
+        wxLogMessage("Read %d points from the disk cache.", drawn.loaded);
+    if (drawn.reused)
+        wxLogMessage("Reused %d points of the last evaluation.", drawn.reused);
+    if (drawn.mode == emVertices || drawn.mode == emHeightfield)
+        wxLogMessage("Took %d points from the tile cache: %ld hits, %ld misses in total, %d of %d MB used.",
+                     drawn.tiled, tiles.hits(), tiles.misses(), (int)(tiles.size() >> 20), (int)(tiles.budget() >> 20));
+    wxLogMessage("Optimized expression from %d to %d nodes, %d with derivatives.",
+                 (int)valueProgram.nodes(), (int)valueProgram.size(), (int)program.size());
+    const Jit* native = drawn.mode == emHeightfield ? valueJit.get() : jit.get();
+    if (drawn.mode == emGpu)
+        wxLogMessage("Evaluated on the GPU by %d lines of GLSL.", (int)gpuLines);
+    else if (native)
+        wxLogMessage("Evaluated by %d bytes of native code.", (int)native->size());
+    else
+        wxLogMessage("Evaluated by the interpreter.");
+    if (drawn.mode != emGpu) { // Vertices of 8 floats, or (re, im) pairs
+        // A pan uploads only the points it adds, the reused ones stay in the buffer
+        const int reused = drawn.panX || drawn.panY ? 0 : drawn.reused;
+        wxLogMessage("Uploaded %d bytes.", (drawn.mode == emHeightfield ? 8 : 32) * (points + reused + drawn.tiled + drawn.loaded));
+    }
+    if (evalMode != drawn.mode)
+        wxLogMessage("The expression can not be evaluated by %s.", evalModeLabels[evalMode]);
+    wxLogMessage("Time elapsed: %d us.", (int)duration.count());
+}
+
+// Evaluate the vertices of the job's grid with their normals, in place: the
+// points of a level of the progressive evaluation (see levelColumns), copied
+// from the cache or the tiles where they have them, or the points a pan adds
+// (see panColumns).
+// Writes to vertices (the mapped buffer, or graphSamples for a pan) at the
+// slots of the ring buffer. Runs on the worker thread, returns false if cancelled.
+bool Canvas::calcGraph(GraphVertex* vertices, const Job& job, int stride, bool coarsest)
+{
+    const int res = job.resolution;
+    const float length = job.axisLength;
+
+    // Evaluate function and its partial derivatives row by row in batches using parallel processing
+    tbb::parallel_for(tbb::blocked_range<int>(0, (res-1) / stride + 1), [&](const tbb::blocked_range<int>& rows) {
+        vector<int> cols;
+        vector<double> xs(res), ys(res), re(3*res), im(3*res);
+
+        for (int r=rows.begin(); r != rows.end() && !jobCancel; ++r) {
+            const int j = r * stride;
+            float y = gridPoint(job.centerY, length, res, j);
+            auto store = [&](int i, const GraphVertex& v) { vertices[job.slot(i, j)] = v; };
+            if (job.panX || job.panY) {
+                panColumns(res, j, job.panX, job.panY, cols);
+            } else {
+                levelColumns(res, j, stride, coarsest, cols);
+                takeCached(cacheColumns, cacheRows[j], cols, [&](int i, int k) {
+                    store(i, (*cache.vertices)[cache.grid.slot(k, cacheRows[j])]);
+                });
+            }
+            takeTiled(fromTiles, res, j, cols);
+            const int n = cols.size();
+            for (int k=0; k < n; ++k)
+                xs[k] = gridPoint(job.centerX, length, res, cols[k]);
+            std::fill(ys.begin(), ys.begin() + n, y);
+            evalPoints(program, jit.get(), n, xs.data(), ys.data(), re.data(), im.data());
+
+            // Real and complex part of the function value goes to the shader,
+            // the normals at (x,y,re(z)) and (x,y,im(z)) are (-df/dx, -df/dy, normZ)
+            const double *dxRe = re.data() + n, *dyRe = dxRe + n;
+            const double *dxIm = im.data() + n, *dyIm = dxIm + n;
+            for (int k=0; k < n; ++k)
+                store(cols[k], { { (float)xs[k], y, (float)re[k], (float)im[k] },
+                                 { slope(dxRe[k]), slope(dyRe[k]), slope(dxIm[k]), slope(dyIm[k]) } });
+        }
+    });
+
+    return !jobCancel;
+}
+
+// Evaluate the values of the job's grid as (re, im) pairs, the points of a level
+// like calcGraph. heightShader computes the vertices and normals. Runs on the
+// worker thread, returns false if cancelled.
+bool Canvas::calcHeightfield(float* values, const Job& job, int stride, bool coarsest)
+{
+    const int res = job.resolution;
+    const float length = job.axisLength;
+
+    // Evaluate function row by row in batches using parallel processing
+    tbb::parallel_for(tbb::blocked_range<int>(0, (res-1) / stride + 1), [&](const tbb::blocked_range<int>& rows) {
+        vector<int> cols;
+        vector<double> xs(res), ys(res), re(res), im(res);
+
+        for (int r=rows.begin(); r != rows.end() && !jobCancel; ++r) {
+            const int j = r * stride;
+            float y = gridPoint(job.centerY, length, res, j);
+            float* row = values + 2 * j * res;
+            levelColumns(res, j, stride, coarsest, cols);
+            takeCached(cacheColumns, cacheRows[j], cols, [&](int i, int k) {
+                const float* cached = cache.values->data() + 2 * cache.grid.slot(k, cacheRows[j]);
+                row[2 * i] = cached[0];
+                row[2 * i + 1] = cached[1];
+            });
+            takeTiled(fromTiles, res, j, cols);
+            const int n = cols.size();
+            for (int k=0; k < n; ++k)
+                xs[k] = gridPoint(job.centerX, length, res, cols[k]);
+            std::fill(ys.begin(), ys.begin() + n, y);
+            evalPoints(valueProgram, valueJit.get(), n, xs.data(), ys.data(), re.data(), im.data());
+
+            for (int k=0; k < n; ++k) {
+                row[2 * cols[k]] = (float)re[k];
+                row[2 * cols[k] + 1] = (float)im[k];
+            }
+        }
+    });
+
+    return !jobCancel;
+}
@@ -9,6 +9,11 @@
 
 #pragma once
 #include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
 #include <cstdio>
 #include <complex>
 #include <GL/glew.h>
@@ -19,8 +24,21 @@
 #include "wx/wx.h"
 #include "wx/glcanvas.h"
 #include "expr.hpp"
+#include "program.hpp"
+#include "jit.hpp"
+#include "glsl.hpp"
 #include "shader.hpp"
 #include "buffers.hpp"
+#include "topology.hpp"
+#include "adaptive.hpp"
+#include "tiles.hpp"
+#include "gridfile.hpp"
+
+// Vertex of the graph: position (x, y, re, im) and the slopes of the real and imaginary part
+struct GraphVertex {
+    float pos[4];
+    float norm[4];
+};
 
 class Canvas : public wxGLCanvas
 {
@@ -33,6 +51,15 @@ public:
 
     inline static const wxArrayString graphStyleLabels{ "Filled Grid", "Fill", "Grid" };
 
+    enum EvalMode {
+        emVertices = 0,     // CPU evaluates the vertices with exact normals
+        emAdaptive,         // Like emVertices, on a mesh refined where the error is large
+        emHeightfield,      // CPU evaluates the values only, the shader does the rest
+        emGpu,              // The shader evaluates the expression
+    };
+
+    inline static const wxArrayString evalModeLabels{ "CPU", "CPU Adaptive", "CPU Heightfield", "GPU" };
+
     Canvas(mainFrame* parent, const wxGLAttributes& attrs);
     ~Canvas();
 
@@ -46,8 +73,11 @@ public:
     void setExpression(const std::string&);
     void setGraphStyle(GraphStyle);
     void setGraphImag(bool);
+    void setEvalMode(EvalMode);
     void setResolution(int res=0);
     int getResolution();
+    void setCacheSize(int megabytes);
+    int getCacheSize();
 
 private:
     mainFrame *parent;      // Parent window
@@ -55,12 +85,33 @@ private:
     wxGLContext* oglCtx;    // OpenGL context
 
     Shader graphShader, labelShader;
-    VertexArray graph, axis, label;
+    Shader gpuShader;       // Variant of graphShader evaluating the expression
+    Shader heightShader;    // Variant of graphShader reading the values from heightfield
+    Shader ringShader;      // Variant of graphShader reading the vertices of emVertices from ringVertices
+    VertexArray graph[2];   // Front (drawn) and back (being evaluated) vertices
+    VertexArray axis, label;
+    VertexArray gridGraph;  // Indices only, gpuShader or heightShader compute the vertices
     Texture labelX, labelY, labelZ;
+    FloatTexture heightfield; // Values of the expression on the grid
+    BufferTexture ringVertices; // The vertices of graph[front], in the order of the ring buffer
+    GLint ringTexels;         // Most texels of ringVertices
+    std::vector<float> heightValues; // Back buffer of heightfield
+    std::vector<float> heightStaged; // Copy of a coarse level of heightValues
+    std::mutex heightMutex;          // Guards heightStaged
+    std::unique_ptr<AdaptiveMesh> mesh; // Result of the worker for emAdaptive
+    std::vector<GraphVertex> graphSamples; // Points a pan adds, at their slots of the ring buffer
+
 
     // Expression to evaluate:
     std::string exprStr;
+    uint64_t exprHash;      // Key of its samples in tiles and the disk cache
     Expr<std::complex<double> > expr;
+    Program<std::complex<double> > program; // Compiled form of expr
+    std::unique_ptr<Jit> jit;               // Native code of program, nullptr if not available
+    Program<std::complex<double> > valueProgram; // Like program, without the derivatives
+    std::unique_ptr<Jit> valueJit;          // Native code of valueProgram
+    std::string gpuCode;                    // GLSL function of expr, empty if there is none
+    size_t gpuLines;                        // Statements in gpuCode
 
     glm::vec3 camPos;       // Camera position
     int scr_h, scr_w;       // Screen height, width
@@ -68,24 +119,88 @@ private:
     float theta, rho;       // Angles for camera rotation around origin
     float camDist;          // Zoom level
     float labelCX, labelCY; // Center of label
+    float centerX, centerY; // Center of the plotted domain
+    float panRestX, panRestY; // Panned less than a grid step
 
     wxPoint dragPos;
     bool needsRecalc;   // Need to call evalExpression
     bool isInitialized; // OpenGL ready flag
     bool imagWorld;     // z axis should be imaginary value
-    bool isBusy;        // Calculation in progress
+    bool gpuStale;      // gpuShader needs to be compiled for gpuCode
 
     Canvas::GraphStyle graphStyle;
+    Canvas::EvalMode evalMode;  // Selected evaluation
+
+    // An evaluation of the graph
+    struct Job {
+        Canvas::EvalMode mode = emVertices; // The GPU falls back to the CPU
+        int resolution = 0;     // 0 for none
+        float axisLength = 0.0f;
+        float centerX = 0.0f, centerY = 0.0f; // The grid covers center +- axisLength
+        int offsetX = 0, offsetY = 0; // Grid column i is stored at (i + offsetX) % resolution, row j likewise
+        int panX = 0, panY = 0; // Steps the drawn grid is shifted by, only the new points are evaluated
+        int stride = 1;         // Level drawn: every stride-th grid point
+        int buffer = 0;         // Vertices written to graph[buffer]
+        int points = 0;         // Evaluations
+        int reused = 0;         // Points copied from the cache
+        int tiled = 0;          // Points copied from tiles
+        int loaded = 0;         // Points read from the disk cache
+        TileCache<GraphVertex>::Grid tileGrid; // Position of the grid in tiles
+        std::chrono::high_resolution_clock::time_point start;
+
+        // Index of grid point (i, j) in the ring buffer
+        size_t slot(int i, int j) const { return (i + offsetX) % resolution + (size_t)((j + offsetY) % resolution) * resolution; }
+    };
+
+    Job job;                    // Last started evaluation
+    Job drawn;                  // Evaluation of the drawn graph
+
+    // Samples of the last complete evaluation on the grid. The next one copies
+    // the points its grid shares with it (after zooming by powers of 2, or at
+    // a multiple of the resolution) instead of evaluating them again. A pan
+    // shifts the vertices in their ring buffer, graph[front] and the cache.
+    // The samples are shared with saver, which stores them once they are
+    // swapped in: an evaluation replaces them, a pan changes a copy while shared.
+    struct SampleCache {
+        Job grid;                           // Its evaluation, resolution 0 if empty
+        std::shared_ptr<std::vector<GraphVertex> > vertices; // Of emVertices, in the order of the ring buffer
+        std::shared_ptr<std::vector<float> > values;         // Of emHeightfield, like heightValues
+    };
+
+    SampleCache cache;
+    std::vector<int> cacheColumns, cacheRows; // Of the cache at each column and row of the job's grid, -1 if none
+    TileCache<GraphVertex> tiles; // Samples of the recent expressions and views, for the heightfield too (values only)
+    std::vector<uint8_t> fromTiles; // Grid point i + j * resolution of the job was copied from tiles
+    std::string gridDir;        // Directory of the disk cache, empty if there is none
+    int front;                  // Index of the drawn graph
+    std::thread worker;         // Evaluates job on the CPU
+    std::thread saver;          // Stores the cache's grid in tiles and the disk cache
+    std::atomic<bool> jobCancel; // Stop the worker
+    std::atomic<int> jobStride; // Finished level to swap in, 0 for none
 
     float axisLength;
     float labelUnit;
 
-    void setupIndices();
     void setupLabels();
     void refreshCam();  // Apply rotation of the cam
     void render(wxDC&); // Main drawing routine
 
-    void calcGraph();   // Evaluate the expression and buffer GL data
+    // Evaluate a level of the expression on the grid, return false if cancelled
+    bool calcGraph(GraphVertex* vertices, const Job&, int stride, bool coarsest);
+    bool calcHeightfield(float* values, const Job&, int stride, bool coarsest);
+
+    void startJob();    // Start evaluating the graph in the background
+    bool startPan();    // Start evaluating the points a pan of the drawn grid adds
+    bool drawsRing(int resolution) const; // ringShader draws the grid, it can be panned
+    void takeTiles(GraphVertex* vertices); // Copy the points of the job that tiles has
+    void storeTiles(const Job&, const GraphVertex* vertices, const float* values); // Store the points of the job in tiles
+    bool loadGrid();    // Read the grid of the job from the disk cache
+    void saveGrid();    // Store the cache's grid in tiles and the disk cache, in the background
+    GridFile::Header gridHeader(const Job&) const;
+    std::string gridPath(const Job&) const;
+    void cancelJob();   // Stop the evaluation, its result is dropped
+    void finishJob();   // Swap in the latest evaluated level
+    void logJob();
     void initGL();
 
     wxDECLARE_EVENT_TABLE();
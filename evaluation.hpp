@@ -0,0 +1,72 @@
+/*
+ * File: evaluation.hpp
+ * --------------------
+ *
+ * Defines how the plot evaluates an expression on the CPU: its variables and
+ * constants, the coordinates of the grid points, the batch evaluation of the
+ * points and the slopes of the normals. Shared by the canvas and the tools
+ * without wx (batch, glsl-test), so they compute the same grids.
+ */
+
+#pragma once
+#include <complex>
+#include <vector>
+#include <map>
+#include <string>
+#include <cmath>
+#include <algorithm>
+#include "program.hpp"
+#include "jit.hpp"
+
+// Variables of an expression, in the order of the values passed to the program
+static const std::vector<std::string> exprVars = { "x", "y", "z" };
+
+// Indices of the real variables in exprVars
+static const std::vector<int> exprRealVars = { 0, 1 };
+
+// Partial derivatives of the variables in x and y, the program computes those of the function too
+static const std::vector<std::pair<std::complex<double>, std::complex<double> > > exprGradients = {
+    { 1.0, 0.0 }, { 0.0, 1.0 }, { 1.0, std::complex<double>(0.0, 1.0) }
+};
+
+// Constants folded into the expression as literals
+static const std::map<std::string, std::complex<double> > exprConsts = {
+    {"i", std::complex<double>(0.0, 1.0)},
+    {"e", std::complex<double>(M_E, 0.0)},
+    {"pi", std::complex<double>(M_PI, 0.0)},
+};
+
+// GLSL function evaluating the expression on the GPU and the values of the variables in it
+static const std::string glslSignature = "vec2 f(float x, float y)";
+static const std::vector<std::string> glslVars = { "vec2(x, 0.0)", "vec2(y, 0.0)", "vec2(x, y)" };
+
+// Coordinate of the i-th of res grid points covering center +- length, in single precision
+inline float gridPoint(float center, float length, int res, int i)
+{
+    return center - length + 2.0f * i * length / (res-1);
+}
+
+// Evaluate program at the n points (xs[k], ys[k]): the value and the derivatives
+// (if compiled with exprGradients) of point k go to re[m*n + k], im[m*n + k].
+// Runs the native code of jit if not nullptr, else the interpreter.
+inline void evalPoints(const Program<std::complex<double> >& program, const Jit* jit, int n,
+                       const double* xs, const double* ys, double* re, double* im)
+{
+    thread_local std::vector<double> zeros;
+    if ((int)zeros.size() < n)
+        zeros.resize(n, 0.0);
+
+    // Variables x, y, z in structure-of-arrays layout
+    const double* varsRe[] = { xs, ys, xs };
+    const double* varsIm[] = { zeros.data(), zeros.data(), ys };
+    if (jit)
+        jit->batch(n, varsRe, varsIm, re, im);
+    else
+        program.batch(n, varsRe, varsIm, re, im);
+}
+
+// Slope for the normals, steep or undefined ones are clamped
+inline float slope(double d)
+{
+    return std::isnan(d) ? 0.0f : (float)std::clamp(-d, -1e6, 1e6);
+}
@@ -8,41 +8,172 @@
  * - Enter any expression in variables
  * - Define the expression variables e.g. by entering z=(3,4) for 3+4i
  * - Evaluate the expression by pressing enter
+ * - Enter b to benchmark the expression on a 1000x1000 grid in x, y, z
+ * - Enter r to run this benchmark on the example expressions of the README
+ * - Enter p to benchmark the parser on long generated expressions
  */
 
 #include <complex>
+#include <chrono>
 #include "expr.hpp"
+#include "program.hpp"
+#include "functions.hpp"
+#include "jit.hpp"
 
 using namespace std;
 
 typedef complex<double> MyT;
 
 template class Expr<MyT>;
+template class Program<MyT>;
 
-int main()
+// Evaluate expr on a grid over [-10,10]^2 with the tree walker and the compiled program
+static void benchmark(const Expr<MyT>& expr, map<string, MyT> vars, int res=1001)
 {
-    Expr<MyT>::funcs1 = {
-        {   "sin", [](MyT x) { return sin(x); } },
-        {   "cos", [](MyT x) { return cos(x); } },
-        {   "log", [](MyT x) { return log(x); } },
-        {    "ln", [](MyT x) { return log(x); } },
-        {   "exp", [](MyT x) { return exp(x); } },
-        {  "sqrt", [](MyT x) { return sqrt(x); } },
-        {   "tan", [](MyT x) { return tan(x); } },
-        {  "atan", [](MyT x) { return atan(x); } },
-        {  "asin", [](MyT x) { return asin(x); } },
-        {  "acos", [](MyT x) { return acos(x); } },
-        {   "abs", [](MyT x) { return (MyT) abs(x); } },
-        {    "re", [](MyT x) { return (MyT) x.real(); } },
-        {    "im", [](MyT x) { return (MyT) x.imag(); } },
-        {  "conj", [](MyT x) { return conj(x); } },
+    vars["x"] = vars["y"] = vars["z"] = 0.0;
+    vector<string> keys;
+    vector<MyT> values;
+    for (const auto& v : vars) {
+        keys.push_back(v.first);
+        values.push_back(v.second);
+    }
+    Expr<MyT> bound(expr);
+    bound.bind(keys);
+    int ix = find(keys.begin(), keys.end(), "x") - keys.begin();
+    int iy = find(keys.begin(), keys.end(), "y") - keys.begin();
+    int iz = find(keys.begin(), keys.end(), "z") - keys.begin();
+    Program<MyT> prog(bound, { ix, iy });
+
+    auto grid = [&](auto&& eval) {
+        MyT sum = 0.0;
+        auto start = chrono::high_resolution_clock::now();
+        for (int j=0; j < res; ++j) {
+            for (int i=0; i < res; ++i) {
+                double x = -10.0 + 20.0 * i / (res-1);
+                double y = -10.0 + 20.0 * j / (res-1);
+                sum += eval(x, y);
+            }
+        }
+        auto duration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+        cout << " (checksum " << sum << "): " << duration.count() << " us" << endl;
     };
 
-    Expr<MyT>::funcs2 = {
-        // {"max", [](MyT x, MyT y) { return x > y ? x : y; }},
-        // {"min", [](MyT x, MyT y) { return x < y ? x : y; }}
+    cout << "Tree walker";
+    grid([&](double x, double y) {
+        vars["x"] = x;
+        vars["y"] = y;
+        vars["z"] = MyT(x, y);
+        return expr(vars);
+    });
+
+    cout << "Bound tree walker";
+    grid([&](double x, double y) {
+        values[ix] = x;
+        values[iy] = y;
+        values[iz] = MyT(x, y);
+        return bound(values.data());
+    });
+
+    cout << "Compiled (" << prog.nodes() << " nodes, " << prog.size() << " instructions, " << prog.slots() << " slots)";
+    grid([&](double x, double y) {
+        values[ix] = x;
+        values[iy] = y;
+        values[iz] = MyT(x, y);
+        return prog(values.data());
+    });
+
+    // Batches of one grid row, remaining variables are broadcast
+    vector<vector<double> > re(keys.size(), vector<double>(res)), im(keys.size(), vector<double>(res));
+    vector<const double*> varsRe, varsIm;
+    for (size_t k=0; k < keys.size(); ++k) {
+        fill(re[k].begin(), re[k].end(), values[k].real());
+        fill(im[k].begin(), im[k].end(), values[k].imag());
+        varsRe.push_back(re[k].data());
+        varsIm.push_back(im[k].data());
+    }
+    vector<double> outRe(3*res), outIm(3*res); // Room for the derivatives
+    auto rows = [&](auto&& batch) {
+        MyT sum = 0.0;
+        auto start = chrono::high_resolution_clock::now();
+        for (int j=0; j < res; ++j) {
+            for (int i=0; i < res; ++i) {
+                re[ix][i] = re[iz][i] = -10.0 + 20.0 * i / (res-1);
+                re[iy][i] = im[iz][i] = -10.0 + 20.0 * j / (res-1);
+            }
+            batch(res, varsRe.data(), varsIm.data(), outRe.data(), outIm.data());
+            for (int i=0; i < res; ++i)
+                sum += MyT(outRe[i], outIm[i]);
+        }
+        auto duration = chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - start);
+        cout << " (checksum " << sum << "): " << duration.count() << " us" << endl;
     };
 
+    cout << "Batched";
+    rows([&](auto... args) { prog.batch(args...); });
+
+    Jit jit(prog);
+    if (jit.compiled()) {
+        cout << "JIT (" << jit.size() << " bytes)";
+        rows([&](auto... args) { jit.batch(args...); });
+    } else {
+        cout << "JIT not available on this machine" << endl;
+    }
+
+    // The value with its partial derivatives in x and y, as the canvas computes it
+    vector<pair<MyT, MyT> > gradients(keys.size());
+    gradients[ix] = { 1.0, 0.0 };
+    gradients[iy] = { 0.0, 1.0 };
+    gradients[iz] = { 1.0, MyT(0.0, 1.0) };
+    Program<MyT> derived(bound, { ix, iy }, gradients);
+    Jit derivedJit(derived);
+    cout << "With derivatives (" << derived.size() << " instructions, " << derived.slots() << " slots)";
+    if (derivedJit.compiled())
+        rows([&](auto... args) { derivedJit.batch(args...); });
+    else
+        rows([&](auto... args) { derived.batch(args...); });
+}
+
+// Parse and compile generated expressions of the given number of terms
+static void parseBenchmark(int terms=100000)
+{
+    // Taylor polynomials of ln(1+z) as a sum, and of exp(z) in Horner form nested as deep as it has terms
+    ostringstream sum, horner;
+    for (int k=1; k < terms; ++k) {
+        sum << (k % 2 ? " + " : " - ") << "z^" << k << "/" << k;
+        horner << "1+z/" << k << "(";
+    }
+    horner << "1" << string(terms - 1, ')');
+
+    for (const string& s : { sum.str(), horner.str() }) {
+        auto start = chrono::high_resolution_clock::now();
+        Expr<MyT> expr(s);
+        auto parsed = chrono::high_resolution_clock::now();
+        Expr<MyT> bound(expr);
+        bound.bind({ "z" });
+        Program<MyT> prog(bound);
+        auto compiled = chrono::high_resolution_clock::now();
+        MyT z = 0.5;
+        double t = chrono::duration<double>(parsed - start).count();
+        cout << s.size() / 1e6 << " MB, " << expr.size() << " nodes: parsed in " << t * 1e3 << " ms ("
+             << s.size() / 1e6 / t << " MB/s), compiled in "
+             << chrono::duration<double, milli>(compiled - parsed).count() << " ms, value at 0.5: " << prog(&z) << endl;
+    }
+}
+
+// Example expressions of the README
+static const char* examples[] = {
+    "atan(-10 + x^2 + y^2 / 5)",
+    "2sqrt(max(0,1-x^2/64-y^2/64))cos(sqrt(x^2+y^2))",
+    "sin(ln(exp(z)))",
+    "(sin(x^2 - y^2)) / (1 + sqrt(x^2 + y^2))",
+    "sqrt(max(0,1-(sqrt(x^2+y^2)-2)^2))",
+    "z^7exp(-abs(z)^2)",
+};
+
+int main()
+{
+    registerFunctions();
+
     Expr<MyT> expr;
     map<string, MyT> vars;
 
@@ -54,6 +185,32 @@ int main()
 
         if (s == "q") break;
 
+        if (s == "b") {
+            try {
+                vars["i"] = complex<double>(0, 1.0);
+                vars["I"] = complex<double>(0, 1.0);
+                benchmark(expr, vars);
+            } catch (const invalid_argument& e) {
+                cerr << e.what() << endl;
+            }
+            continue;
+        }
+
+        if (s == "p") {
+            parseBenchmark();
+            continue;
+        }
+
+        if (s == "r") {
+            vars["i"] = complex<double>(0, 1.0);
+            vars["I"] = complex<double>(0, 1.0);
+            for (const char* example : examples) {
+                cout << endl << example << endl;
+                benchmark(Expr<MyT>(example), vars);
+            }
+            continue;
+        }
+
         size_t split;
         if ((split = s.find('=')) != string::npos) {
             MyT value;
@@ -63,7 +220,15 @@ int main()
             try {
                 vars["i"] = complex<double>(0, 1.0);
                 vars["I"] = complex<double>(0, 1.0);
-                cout << "Evaluated: " << expr(vars) << endl;
+                vector<string> keys;
+                vector<MyT> values;
+                for (const auto& v : vars) {
+                    keys.push_back(v.first);
+                    values.push_back(v.second);
+                }
+                Expr<MyT> bound(expr);
+                bound.bind(keys);
+                cout << "Evaluated: " << Program<MyT>(bound)(values.data()) << endl;
             } catch (const invalid_argument& e) {
                 cerr << e.what() << endl;
             }
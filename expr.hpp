@@ -4,113 +4,387 @@
  *
  * Defines a template class for parsing and evaluating mathematical expressions
  * involving variables and functions. May be instantiated with complex<T>.
+ *
+ * The nodes of the expression tree are stored in one contiguous array and
+ * refer to their children by 32-bit indices, names are kept in a single
+ * string. Copying an expression therefore copies two flat buffers, moving
+ * it is O(1), and evaluation walks compact memory.
+ *
+ * Parsing is iterative: a lexer over a std::string_view feeds an operator
+ * precedence parser with explicit stacks, so neither the length of an
+ * expression nor its nesting depth is limited by the call stack. Nodes are
+ * appended in post-order, every node follows its children, which lets
+ * evaluation and compilation make a single pass over the array.
+ *
+ * Expressions can also be evaluated on dual numbers, which carry the change
+ * of a value along one direction with it (forward-mode differentiation).
+ * Functions provide their derivatives for this. Non-holomorphic functions
+ * like abs or conj give both Wirtinger derivatives, d/dz and d/dconj(z).
  */
 
+#pragma once
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <cmath>
+#include <complex>
 #include <string>
+#include <string_view>
+#include <cstdint>
+#include <charconv>
+#include <type_traits>
 #include <map>
+#include <vector>
 #include <algorithm>
 
+template <class T> class Program;
+template <class T> class Glsl;
+
+// A value and its change along one direction
+template <class T>
+struct Dual {
+    T value, change;
+
+    Dual(const T& value = T(0), const T& change = T(0)) : value(value), change(change) {}
+};
+
+template <class T> Dual<T> operator+(const Dual<T>& a, const Dual<T>& b) { return { a.value + b.value, a.change + b.change }; }
+template <class T> Dual<T> operator-(const Dual<T>& a, const Dual<T>& b) { return { a.value - b.value, a.change - b.change }; }
+template <class T> Dual<T> operator*(const Dual<T>& a, const Dual<T>& b)
+{
+    return { a.value * b.value, a.change * b.value + a.value * b.change };
+}
+template <class T> Dual<T> operator/(const Dual<T>& a, const Dual<T>& b)
+{
+    T r = a.value / b.value;
+    return { r, (a.change - r * b.change) / b.value };
+}
+template <class T> Dual<T> pow(const Dual<T>& a, const Dual<T>& b)
+{
+    T r = pow(a.value, b.value);
+    if (b.change == T(0)) // Constant exponent, also defined for a = 0
+        return { r, b.value == T(0) ? T(0) : b.value * pow(a.value, b.value - T(1)) * a.change };
+    return { r, r * (b.change * log(a.value) + b.value * a.change / a.value) };
+}
+
+// Real type R of T = complex<R>, T itself otherwise
+template <class T> struct RealPart { using type = T; };
+template <class R> struct RealPart<std::complex<R> > { using type = R; };
+
 template <class T>
 class Expr
 {
-    T value;             // Holds a numeric value for leaf nodes
-    Expr *left, *right;  // Pointers to sub-expressions (binary tree structure)
-    char op;             // Operator (+, -, *, /, ^)
-    std::string name;    // Variable or function name
-
-    enum ParseLevel { SUMS=0, FACTORS, POWERS, OPERANDS, FUNC };
-
-    // Explicitly perform shallow copy
-    Expr(Expr* expr)
-      : value(expr->value),
-        left(expr->left),
-        right(expr->right),
-        op(expr->op),
-        name(expr->name) {}
-
-    // Recursive constructor to parse expressions
-    Expr(std::istringstream& str, int level)
-      : value(0),
-        left(nullptr),
-        right(nullptr),
-        op(0),
-        name("")
+    friend class Program<T>; // Compiles the tree into a flat instruction stream
+    friend class Glsl<T>;    // Translates the tree to GLSL
+
+public:
+    using fp1 = T (*)(T);    // 1-arg function pointer type
+    using fp2 = T (*)(T, T); // 2-arg function pointer type
+    using R = typename RealPart<T>::type;
+
+    // 1-arg batch function type: n values of re + i*im to outRe + i*outIm, may work in place
+    using bfp1 = void (*)(size_t, const R*, const R*, R*, R*);
+
+    // A function that may be called in expressions, with one or two arguments.
+    // Derivatives are optional, expressions using functions without them
+    // cannot be differentiated.
+    struct Function {
+        fp1 f1 = nullptr;   // Implementation of a 1-arg function
+        fp2 f2 = nullptr;   // Implementation of a 2-arg function
+        bfp1 bf1 = nullptr; // Batch version of f1, may be nullptr (called point by point then)
+        fp1 df = nullptr;   // Derivative of f1, d/dz
+        bfp1 bdf = nullptr; // Batch version of df, may be nullptr
+        fp1 dfc = nullptr;  // d/dconj(z) of f1, nullptr where f1 is holomorphic
+        fp2 dfx = nullptr;  // Partial derivatives of f2 in its first
+        fp2 dfy = nullptr;  // and its second argument
+        const char* glsl = nullptr; // Name of the GLSL version (see Glsl::library), nullptr if none
+        bool pure = true;   // Equal arguments give equal results, so calls may be folded and merged
+
+        int arity() const { return f2 ? 2 : 1; }
+        bool differentiable() const { return f2 ? dfx && dfy : df != nullptr; }
+    };
+
+private:
+    struct Node {
+        T value;               // Holds a numeric value for leaf nodes
+        const Function* func;  // Function called by this node, resolved when parsing
+        int32_t left, right;   // Indices of sub-expressions (binary tree structure), -1 if none
+        int32_t slot;          // Index of a bound variable, -1 if unbound
+        uint32_t name, length; // Variable or function name, a range of names
+        char op;               // Operator (+, -, *, /, ^)
+    };
+
+    std::vector<Node> nodes; // nodes[0] is the root, all other nodes follow their children
+    std::string names;       // Characters of all names
+
+    // Append an empty node and return its index
+    int32_t add()
     {
-        const std::string level_ops[] = { "+-", "*/", "^" };
-        char c;
-
-        switch (level) {
-            case SUMS:
-            case FACTORS:
-            case POWERS:
-                left = new Expr(str, level + 1);
-                while (level_ops[level].find(str.peek()) != std::string::npos ||
-                       (level == FACTORS && (isalnum(str.peek()) || str.peek() == '('))) {
-
-                    if (right != nullptr) {
-                        left = new Expr(this); // Shallow copy of the current node
-                    }
+        nodes.push_back({ T(0), nullptr, -1, -1, -1, 0, 0, 0 });
+        return nodes.size() - 1;
+    }
 
-                    // Handle omitted '*' for implicit multiplication
-                    if (level_ops[level].find(str.peek()) != std::string::npos) {
-                        str >> op;
-                    } else {
-                        op = '*';
-                    }
+    std::string_view name(const Node& n) const { return std::string_view(names).substr(n.name, n.length); }
 
-                    right = new Expr(str, level == POWERS ? level : level + 1); // fix for x^y^z...
-                }
-                break;
+    struct Token {
+        enum Kind { END, NUMBER, NAME, OP, OPEN, CLOSE, COMMA, OTHER } kind;
+        std::string_view text;
+        size_t pos; // Offset in the text without spaces
+    };
 
-            case OPERANDS:
-                c = str.peek();
-                if (c == '(') {
-                    str >> c; // Consume '('
-                    left = new Expr(str, SUMS);
-                    if (str.peek() == ',') {
-                        // only needed for 2-arg funcs
-                        str >> c;
-                        right = new Expr(str, SUMS);
-                    }
-                    if (str.peek() != ')') {
-                        throw std::invalid_argument("Error: Missing closing ')'.");
+    // Splits a text without spaces into tokens
+    struct Lexer {
+        std::string_view text;
+        size_t pos = 0;
+        std::string prefix; // Characters of the current number, as is_value expects them
+
+        explicit Lexer(std::string_view text) : text(text) {}
+
+        Token next()
+        {
+            const size_t start = pos;
+            if (pos == text.size())
+                return { Token::END, {}, start };
+
+            const char c = text[pos];
+            typename Token::Kind kind = Token::OTHER;
+            if (c == '(') {
+                kind = Token::OPEN;
+                ++pos;
+            } else if (is_value("", c)) {
+                prefix.clear();
+                while (pos < text.size() && is_value(prefix, text[pos]))
+                    prefix.push_back(text[pos++]);
+                kind = Token::NUMBER;
+            } else if (isalpha((unsigned char)c)) {
+                while (pos < text.size() && isalpha((unsigned char)text[pos]))
+                    ++pos;
+                kind = Token::NAME;
+            } else {
+                kind = c == ')' ? Token::CLOSE : c == ',' ? Token::COMMA
+                     : std::string_view("+-*/^").find(c) != std::string_view::npos ? Token::OP : Token::OTHER;
+                ++pos;
+            }
+            return { kind, text.substr(start, pos - start), start };
+        }
+    };
+
+    // Value of a number token, parsed without a stream where T allows it
+    static T number(std::string_view s)
+    {
+        if constexpr (std::is_floating_point_v<R> && std::is_constructible_v<T, R>) {
+            R x;
+            auto [end, err] = std::from_chars(s.data(), s.data() + s.size(), x);
+            if (err == std::errc() && end == s.data() + s.size())
+                return T(x);
+        }
+        T x(0);
+        std::istringstream(std::string(s)) >> x;
+        return x;
+    }
+
+    // Throw an error at offset pos of the text without spaces, reported as a position in source
+    [[noreturn]] static void error(const std::string& msg, std::string_view source, size_t pos)
+    {
+        for (size_t i=0; i < source.size(); ++i) {
+            if (!isspace((unsigned char)source[i]) && pos-- == 0)
+                throw std::invalid_argument("Error: " + msg + " at position " + std::to_string(i + 1) + ".");
+        }
+        throw std::invalid_argument("Error: " + msg + " at the end.");
+    }
+
+    // Operator precedence parser. Sums bind weakest, then products, where a
+    // missing '*' is implied before a name, a digit or '(', then powers,
+    // which associate to the right. A missing operand is 0, e.g. in -x.
+    // Parentheses may hold a second argument after a comma for 2-arg functions.
+    void parse(std::string_view source)
+    {
+        std::string text;
+        text.reserve(source.size());
+        for (char c : source) {
+            if (!isspace((unsigned char)c))
+                text.push_back(c);
+        }
+
+        // An open parenthesis, with the function it belongs to
+        struct Group {
+            size_t pos;
+            const Function* func;
+            uint32_t name, length;
+            int32_t first = -1; // First argument, once a comma is read
+        };
+
+        std::vector<int32_t> operands;
+        std::vector<char> ops; // Binary operators and '(' for open groups
+        std::vector<Group> groups;
+        auto precedence = [](char op) { return op == '^' ? 3 : op == '*' || op == '/' ? 2 : 1; };
+        auto reduce = [&]() {
+            int32_t k = add();
+            nodes[k].op = ops.back();
+            nodes[k].right = operands.back();
+            operands.pop_back();
+            nodes[k].left = operands.back();
+            operands.back() = k;
+            ops.pop_back();
+        };
+
+        nodes.reserve(text.size() + 1);
+        Lexer lexer{ text };
+        Token tok = lexer.next();
+        bool operand = true; // Expecting an operand, otherwise an operator
+
+        while (true) {
+            if (operand) {
+                operand = false;
+                if (tok.kind == Token::OPEN) {
+                    groups.push_back({ tok.pos, nullptr, 0, 0 });
+                    ops.push_back('(');
+                    operand = true;
+                } else if (tok.kind == Token::NUMBER) {
+                    int32_t k = add();
+                    nodes[k].value = number(tok.text);
+                    operands.push_back(k);
+                } else if (tok.kind == Token::NAME) {
+                    auto f = functions.find(tok.text);
+                    if (f != functions.end()) {
+                        Token open = lexer.next();
+                        if (open.kind != Token::OPEN)
+                            error("Function '" + std::string(tok.text) + "' expects '('", source, open.pos);
+                        groups.push_back({ open.pos, &f->second, (uint32_t)names.size(), (uint32_t)tok.text.size() });
+                        ops.push_back('(');
+                        operand = true;
+                    } else {
+                        int32_t k = add();
+                        nodes[k].name = names.size();
+                        nodes[k].length = tok.text.size();
+                        operands.push_back(k);
                     }
-                    str >> c; // Consume ')'
-                } else if (is_value("", c)) {
-                    std::string val_str;
-                    while (is_value(val_str, str.peek()))
-                        val_str.push_back(str.get());
-                    std::istringstream(val_str) >> value;
+                    names += tok.text;
                 } else {
-                    left = new Expr(str, FUNC);
+                    operands.push_back(add()); // Missing operand, keep the token
+                    continue;
                 }
-                break;
+                tok = lexer.next();
+                continue;
+            }
 
-            case FUNC:
-                while (isalpha(str.peek())) {
-                    str >> c;
-                    name.push_back(c);
-                }
-                if (funcs1.find(name) != funcs1.end() || funcs2.find(name) != funcs2.end()) {
-                    if (str.peek() != '(') {
-                        throw std::invalid_argument("Error: Function '" + name + "' expects '('.");
+            char op;
+            if (tok.kind == Token::OP) {
+                op = tok.text[0];
+            } else if (tok.kind == Token::NAME || tok.kind == Token::OPEN ||
+                       (tok.kind == Token::NUMBER && isalnum((unsigned char)tok.text[0]))) {
+                op = '*'; // Implicit multiplication, keep the token
+            } else if ((tok.kind == Token::COMMA || tok.kind == Token::CLOSE) && !groups.empty()) {
+                while (ops.back() != '(')
+                    reduce();
+                Group& g = groups.back();
+                if (tok.kind == Token::COMMA) {
+                    if (g.first >= 0)
+                        error("Missing closing ')'", source, tok.pos);
+                    g.first = operands.back();
+                    operands.pop_back();
+                    operand = true;
+                } else {
+                    // The group keeps its arguments in left and right
+                    int32_t k = add();
+                    nodes[k].left = g.first >= 0 ? g.first : operands.back();
+                    nodes[k].right = g.first >= 0 ? operands.back() : -1;
+                    if (g.func) {
+                        if ((g.first >= 0 ? 2 : 1) != g.func->arity())
+                            error("Function '" + names.substr(g.name, g.length) + "' expects "
+                                  + (g.func->arity() == 1 ? "one argument" : "two arguments"), source, tok.pos);
+                        int32_t f = add();
+                        nodes[f].func = g.func;
+                        nodes[f].name = g.name;
+                        nodes[f].length = g.length;
+                        nodes[f].left = k;
+                        k = f;
                     }
-                    left = new Expr(str, OPERANDS);
+                    operands.back() = k;
+                    ops.pop_back();
+                    groups.pop_back();
                 }
+                tok = lexer.next();
+                continue;
+            } else {
                 break;
+            }
+
+            while (!ops.empty() && ops.back() != '(' &&
+                   (precedence(ops.back()) > precedence(op) || (precedence(ops.back()) == precedence(op) && op != '^')))
+                reduce();
+            ops.push_back(op);
+            if (tok.kind == Token::OP)
+                tok = lexer.next();
+            operand = true;
         }
+
+        if (!groups.empty())
+            error("Missing closing ')'", source, tok.pos);
+        if (tok.kind != Token::END)
+            error("Unexpected '" + std::string(tok.text) + "'", source, tok.pos);
+        while (!ops.empty())
+            reduce();
+        nodes[0].left = operands.back();
     }
 
-public:
-    using fp1 = T (*)(T);    // 1-arg function pointer type
-    using fp2 = T (*)(T, T); // 2-arg function pointer type
+    static T conjugate(T x)
+    {
+        if constexpr (std::is_same_v<T, std::complex<R> >)
+            return std::conj(x);
+        return x;
+    }
+
+    // Function calls on values and on dual numbers
+    static T call(const Function& f, const T& a, const T& b) { return f.f2 ? f.f2(a, b) : f.f1(a); }
+    static Dual<T> call(const Function& f, const Dual<T>& a, const Dual<T>& b)
+    {
+        if (f.f2)
+            return { f.f2(a.value, b.value), f.dfx(a.value, b.value) * a.change + f.dfy(a.value, b.value) * b.change };
+        T change = f.df(a.value) * a.change;
+        if (f.dfc)
+            change += f.dfc(a.value) * conjugate(a.change);
+        return { f.f1(a.value), change };
+    }
+
+    // Evaluate the nodes in order, children come first. leaf(n) returns the value of a variable.
+    // The values live in a buffer of the thread, reused by the next call (a nested one gets its own).
+    template <class V, class Leaf>
+    V eval(Leaf leaf) const
+    {
+        thread_local std::vector<V> scratch;
+        std::vector<V> v;
+        v.swap(scratch);
+        v.resize(nodes.size());
+        for (size_t i=1; i < nodes.size(); ++i) {
+            const Node& n = nodes[i];
+            switch (n.op) {
+                case '+': v[i] = v[n.left] + v[n.right]; continue;
+                case '-': v[i] = v[n.left] - v[n.right]; continue;
+                case '*': v[i] = v[n.left] * v[n.right]; continue;
+                case '/': v[i] = v[n.left] / v[n.right]; continue;
+                case '^': v[i] = pow(v[n.left], v[n.right]); continue;
+            }
 
-    inline static std::map<std::string, fp1> funcs1 = {}; // 1-arg user-defined functions
-    inline static std::map<std::string, fp2> funcs2 = {}; // 2-arg user-defined functions
+            if (n.func) {
+                if (std::is_same_v<V, Dual<T> > && !n.func->differentiable())
+                    throw std::invalid_argument("Error: Function '" + std::string(name(n)) + "' has no derivative.");
+                const Node& args = nodes[n.left];
+                v[i] = call(*n.func, v[args.left], args.right >= 0 ? v[args.right] : V());
+            } else if (n.length)
+                v[i] = leaf(n);
+            else
+                v[i] = n.left >= 0 ? v[n.left] : V(n.value);
+        }
+        const V result = nodes[0].left >= 0 ? v[nodes[0].left] : V(nodes[0].value);
+        scratch.swap(v);
+        return result;
+    }
+
+public:
+    // User-defined functions by name. Parsed expressions point to the entries,
+    // so functions must not be removed while expressions using them exist.
+    inline static std::map<std::string, Function, std::less<> > functions = {};
 
     // This function prototype checks if the currently examined char of a string
     // belongs to a constant of type T.
@@ -134,80 +408,77 @@ public:
     };
     */
 
-    Expr(Expr&&) = delete; // Disables the move constructor
-
-    // Constructor: Initializes from a std::string and removes spaces
-    Expr(std::string s) : left(nullptr), right(nullptr), op(0)
-    {
-        s.erase(remove_if(s.begin(), s.end(), ::isspace), s.end());
-        std::istringstream str(s);
-        left = new Expr(str, SUMS);
-    }
-
-    // Constructor: Deep copy an expression
-    Expr(const Expr& expr) : value(expr.value), op(expr.op), name(expr.name)
+    // Constructor: Parses an expression, spaces are ignored.
+    // Throws invalid_argument with the position of a syntax error.
+    Expr(std::string_view s)
     {
-        left = expr.left ? new Expr(*expr.left) : nullptr;
-        right = expr.right ? new Expr(*expr.right) : nullptr;
+        add();
+        parse(s);
     }
 
     // Constructor: An empty expression
-    Expr() : value(0.0), left(nullptr), right(nullptr), op(0) {}
+    Expr() { add(); }
 
-    // Destructor: Clean up nodes
-    ~Expr()
-    {
-        delete left;
-        delete right;
-    }
+    // Copies are flat copies of the node array and names, moves take them over
+    Expr(const Expr&) = default;
+    Expr(Expr&&) = default;
+    Expr& operator=(const Expr&) = default;
+    Expr& operator=(Expr&&) = default;
 
-    Expr& operator=(const Expr& other)
-    {
-        if (this != &other) { // Self-assignment check
-            delete left;
-            delete right;
+    size_t size() const { return nodes.size(); } // Number of nodes
 
-            value = other.value;
-            op = other.op;
-            name = other.name;
+    // Resolve variable names to their index in vars and replace the names
+    // in consts by literal values. Throws invalid_argument if a variable
+    // is neither in vars nor in consts.
+    void bind(const std::vector<std::string>& vars, const std::map<std::string, T>& consts = {})
+    {
+        for (Node& n : nodes) {
+            if (!n.length || n.func)
+                continue;
 
-            left = other.left ? new Expr(*other.left) : nullptr;
-            right = other.right ? new Expr(*other.right) : nullptr;
+            std::string s(name(n));
+            auto c = consts.find(s);
+            if (c != consts.end()) {
+                n.value = c->second;
+                n.length = 0;
+                continue;
+            }
+            auto v = std::find(vars.begin(), vars.end(), s);
+            if (v == vars.end())
+                throw std::invalid_argument("Error: Variable '" + s + "' is undefined.");
+            n.slot = v - vars.begin();
         }
-        return *this;
+    }
+
+    // Evaluate a bound expression, vars holds the values in the order of binding
+    T operator()(const T* vars) const
+    {
+        return eval<T>([&](const Node& n) {
+            if (n.slot < 0)
+                throw std::invalid_argument("Error: Variable '" + std::string(name(n)) + "' is undefined.");
+            return vars[n.slot];
+        });
     }
 
     // Evaluate the expression with given variable substitutions
     T operator()(const std::map<std::string, T>& vars) const
     {
-        // Debugging:
-        // if (std::string("+-*/^").find(op) != std::string::npos) {
-        //     cout << "Stacking evaluation of " << op << endl;
-        // }
-
-        switch (op) {
-            case '+': return (*left)(vars) + (*right)(vars);
-            case '-': return (*left)(vars) - (*right)(vars);
-            case '*': return (*left)(vars) * (*right)(vars);
-            case '/': return (*left)(vars) / (*right)(vars);
-            case '^': return pow((*left)(vars), (*right)(vars));
-        }
-
-        if (!name.empty()) {
-            if (funcs1.find(name) != funcs1.end()) {
-                return funcs1[name]((*left->left)(vars));
-            }
-            if (funcs2.find(name) != funcs2.end()) {
-                if (left->right == nullptr)
-                    throw std::invalid_argument("Error: Function '" + name + "' expects two arguments.");
-                return funcs2[name]((*left->left)(vars), (*left->right)(vars));
-            }
-            if (vars.find(name) != vars.end()) {
-                return vars.at(name);
-            }
-            throw std::invalid_argument("Error: Variable '" + name + "' is undefined.");
-        }
+        return eval<T>([&](const Node& n) {
+            auto v = vars.find(std::string(name(n)));
+            if (v == vars.end())
+                throw std::invalid_argument("Error: Variable '" + std::string(name(n)) + "' is undefined.");
+            return v->second;
+        });
+    }
 
-        return left ? (*left)(vars) : value;
+    // Evaluate a bound expression on dual numbers: vars holds the values and
+    // their changes along a direction, the result changes along it by f'.
+    Dual<T> operator()(const Dual<T>* vars) const
+    {
+        return eval<Dual<T> >([&](const Node& n) {
+            if (n.slot < 0)
+                throw std::invalid_argument("Error: Variable '" + std::string(name(n)) + "' is undefined.");
+            return vars[n.slot];
+        });
     }
-};
\ No newline at end of file
+};
@@ -0,0 +1,96 @@
+/*
+ * File: functions.hpp
+ * -------------------
+ *
+ * Registers the functions that may be called in expressions: their complex
+ * implementations with batch versions, derivatives and GLSL versions, and
+ * their real versions for real arguments. Shared by the plotter and the
+ * test programs, so all of them evaluate the same functions.
+ */
+
+#pragma once
+#include <complex>
+#include "expr.hpp"
+#include "program.hpp"
+#include "batchmath.hpp"
+
+inline void registerFunctions()
+{
+    typedef std::complex<double> MyT; // We are parsing expressions in complex numbers
+
+    // Assign custom defined functions to the expression parser class, with vectorized
+    // versions of the 1-arg functions for batch evaluation, derivatives and the names
+    // of the GLSL versions (see Glsl::library). 2-arg: "Fake" max/min....
+    Expr<MyT>::functions = {
+        {  "sin", { .f1 = [](MyT x) { return sin(x); }, .bf1 = BatchMath::sin,
+                    .df = [](MyT x) { return cos(x); }, .bdf = BatchMath::cos,
+                    .glsl = "csin" } },
+        {  "cos", { .f1 = [](MyT x) { return cos(x); }, .bf1 = BatchMath::cos,
+                    .df = [](MyT x) { return -sin(x); },
+                    .glsl = "ccos" } },
+        {  "log", { .f1 = [](MyT x) { return log(x); }, .bf1 = BatchMath::log,
+                    .df = [](MyT x) { return 1.0 / x; },
+                    .glsl = "clog" } },
+        {   "ln", { .f1 = [](MyT x) { return log(x); }, .bf1 = BatchMath::log,
+                    .df = [](MyT x) { return 1.0 / x; },
+                    .glsl = "clog" } },
+        {  "exp", { .f1 = [](MyT x) { return exp(x); }, .bf1 = BatchMath::exp,
+                    .df = [](MyT x) { return exp(x); }, .bdf = BatchMath::exp,
+                    .glsl = "cexp" } },
+        { "sqrt", { .f1 = [](MyT x) { return sqrt(x); }, .bf1 = BatchMath::sqrt,
+                    .df = [](MyT x) { return 0.5 / sqrt(x); },
+                    .glsl = "csqrt" } },
+        {  "tan", { .f1 = [](MyT x) { return tan(x); }, .bf1 = BatchMath::tan,
+                    .df = [](MyT x) { MyT t = tan(x); return 1.0 + t * t; },
+                    .glsl = "ctan" } },
+        { "atan", { .f1 = [](MyT x) { return atan(x); }, .bf1 = BatchMath::atan,
+                    .df = [](MyT x) { return 1.0 / (1.0 + x * x); },
+                    .glsl = "catan" } },
+        { "asin", { .f1 = [](MyT x) { return asin(x); }, .bf1 = BatchMath::asin,
+                    .df = [](MyT x) { return 1.0 / sqrt(1.0 - x * x); },
+                    .glsl = "casin" } },
+        { "acos", { .f1 = [](MyT x) { return acos(x); }, .bf1 = BatchMath::acos,
+                    .df = [](MyT x) { return -1.0 / sqrt(1.0 - x * x); },
+                    .glsl = "cacos" } },
+        // Not holomorphic, with derivatives in z and conj(z)
+        {  "abs", { .f1 = [](MyT x) { return (MyT) abs(x); }, .bf1 = BatchMath::abs,
+                    .df = [](MyT x) { return conj(x) / (2.0 * abs(x)); },
+                    .dfc = [](MyT x) { return x / (2.0 * abs(x)); },
+                    .glsl = "cabs" } },
+        {   "re", { .f1 = [](MyT x) { return (MyT) x.real(); }, .bf1 = BatchMath::re,
+                    .df = [](MyT) { return MyT(0.5); }, .dfc = [](MyT) { return MyT(0.5); },
+                    .glsl = "cre" } },
+        {   "im", { .f1 = [](MyT x) { return (MyT) x.imag(); }, .bf1 = BatchMath::im,
+                    .df = [](MyT) { return MyT(0, -0.5); }, .dfc = [](MyT) { return MyT(0, 0.5); },
+                    .glsl = "cim" } },
+        { "conj", { .f1 = [](MyT x) { return conj(x); }, .bf1 = BatchMath::conj,
+                    .df = [](MyT) { return MyT(0); }, .dfc = [](MyT) { return MyT(1); },
+                    .glsl = "cconj" } },
+        {  "max", { .f2 = [](MyT x, MyT y) { return x.real() > y.real() ? x : y; },
+                    .dfx = [](MyT x, MyT y) { return MyT(x.real() > y.real()); },
+                    .dfy = [](MyT x, MyT y) { return MyT(!(x.real() > y.real())); },
+                    .glsl = "cmax" } },
+        {  "min", { .f2 = [](MyT x, MyT y) { return x.real() < y.real() ? x : y; },
+                    .dfx = [](MyT x, MyT y) { return MyT(x.real() < y.real()); },
+                    .dfy = [](MyT x, MyT y) { return MyT(!(x.real() < y.real())); },
+                    .glsl = "cmin" } },
+    };
+
+    // Real versions for real arguments, where they give the same values as the complex
+    // functions. log, tan and the inverse functions round differently and stay complex.
+    typedef Program<MyT> P;
+    P::realFuncs = {
+        {   "sin", { .f1 = [](double x) { return std::sin(x); }, .bf1 = BatchMath::sin } },
+        {   "cos", { .f1 = [](double x) { return std::cos(x); }, .bf1 = BatchMath::cos } },
+        {   "exp", { .f1 = [](double x) { return std::exp(x); }, .bf1 = BatchMath::exp, .nonNeg = P::ALWAYS } },
+        {  "sqrt", { .f1 = [](double x) { return std::sqrt(x); }, .bf1 = BatchMath::sqrt,
+                     .nonNegArgs = true, .nonNeg = P::ALWAYS } },
+        {   "abs", { .f1 = [](double x) { return std::abs(x); }, .bf1 = BatchMath::abs,
+                     .realValued = true, .nonNeg = P::ALWAYS } },
+        {    "re", { .f1 = [](double x) { return x; }, .realValued = true, .nonNeg = P::IF_ANY } },
+        {    "im", { .f1 = [](double) { return 0.0; }, .realValued = true, .nonNeg = P::IF_ANY } },
+        {  "conj", { .f1 = [](double x) { return x; }, .nonNeg = P::IF_ANY } },
+        {   "max", { .f2 = [](double x, double y) { return x > y ? x : y; }, .nonNeg = P::IF_ANY } },
+        {   "min", { .f2 = [](double x, double y) { return x < y ? x : y; }, .nonNeg = P::IF_ALL } },
+    };
+}
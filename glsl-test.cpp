@@ -0,0 +1,336 @@
+/*
+ * File: glsl-test.cpp
+ * -------------------
+ *
+ * Compares the evaluation of expressions on the GPU (glsl.hpp and the GPU
+ * variant of graph_vertex.glsl) with the CPU reference (Program), within
+ * single precision tolerances. The heightfield variant gets the CPU's values
+ * and has to reproduce them and their neighbour differences, the ring buffer
+ * variant has to find the vertices at their slots. Runs headless on an EGL
+ * context without a surface, e.g. with Mesa's software renderer llvmpipe:
+ *
+ *   make glsl-test && EGL_PLATFORM=surfaceless LIBGL_ALWAYS_SOFTWARE=1 ./glsl-test
+ *
+ * Must run in the directory of the shaders. Returns the number of failed
+ * expressions and ring buffers, more expressions may be given as arguments.
+ */
+
+#include <iostream>
+#include <complex>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "expr.hpp"
+#include "program.hpp"
+#include "functions.hpp"
+#include "evaluation.hpp"
+#include "glsl.hpp"
+#include "shader.hpp"
+#include "buffers.hpp"
+
+using namespace std;
+
+typedef complex<double> MyT;
+
+// The examples of the README and every function
+static const char* examples[] = {
+    "atan(-10 + x^2 + y^2 / 5)",
+    "2sqrt(max(0,1-x^2/64-y^2/64))cos(sqrt(x^2+y^2))",
+    "sin(ln(exp(z)))",
+    "(sin(x^2 - y^2)) / (1 + sqrt(x^2 + y^2))",
+    "sqrt(max(0,1-(sqrt(x^2+y^2)-2)^2))",
+    "z^7exp(-abs(z)^2)",
+    "sin(z/4)", "cos(z/4)", "tan(z/4)", "exp(z/4)", "log(z)", "ln(z/10)", "sqrt(z)",
+    "atan(z)", "asin(z/10)", "acos(z/10)", "abs(z)", "re(z^2)", "im(z^2)", "conj(z)/10",
+    "max(x, y/2)", "min(re(z), 2im(z))", "z^2.5/100", "z^(1+i)", "(z-1)/(z+1)", "z^(-3)", "pi^z/1000",
+};
+
+// Grid of the test, the points avoid the axes (and the branch cuts on them).
+// It is centered off the origin by whole steps, like a panned graph.
+static const int res = 64;
+static const float axisLength = 10.0f;
+static const float step = 2.0f * axisLength / (res - 1);
+static const float centerX = 4 * step, centerY = -2 * step;
+
+// Create an OpenGL 3.3 core context without a surface
+static bool initContext()
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if (display == EGL_NO_DISPLAY)
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (!eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+
+    const EGLint attrs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attrs);
+    if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+        return false;
+
+    glewExperimental = GL_TRUE;
+    int err = glewInit();
+#ifndef IGNORE_GLEW_INIT_RET
+    if (err != GLEW_OK)
+        return false;
+#else
+    (void)err;
+#endif
+
+    // Draws need a complete framebuffer, there is no default one without a surface
+    GLuint fbo, rbo;
+    glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glGenRenderbuffers(1, &rbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, 1, 1);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rbo);
+    return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+// Draw the points of the grid with the shader: fPos and fNorm of the vertices,
+// captured by transform feedback
+static vector<float> capture(const Shader& shader, bool imag)
+{
+    shader.use();
+    shader.uniform("resolution", res);
+    shader.uniform("axisLength", axisLength);
+    shader.uniform("gridLength", axisLength);
+    shader.uniform("gridCenter", glm::vec2(centerX, centerY));
+    shader.uniform("zIsImag", (int)imag);
+    shader.uniform("normZ", 1.0f);
+    shader.uniform("model", glm::mat4(1.0f));
+    shader.uniform("normal", glm::mat3(1.0f));
+    shader.uniform("proj", glm::mat4(1.0f));
+    shader.uniform("view", glm::mat4(1.0f));
+
+    vector<float> out(6 * res * res);
+    GLuint vao, tbo;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(1, &tbo);
+    glBindBuffer(GL_TRANSFORM_FEEDBACK_BUFFER, tbo);
+    glBufferData(GL_TRANSFORM_FEEDBACK_BUFFER, out.size() * sizeof(float), nullptr, GL_STATIC_READ);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, tbo);
+
+    glEnable(GL_RASTERIZER_DISCARD);
+    glBeginTransformFeedback(GL_POINTS);
+    glDrawArrays(GL_POINTS, 0, res * res);
+    glEndTransformFeedback();
+    glDisable(GL_RASTERIZER_DISCARD);
+    glGetBufferSubData(GL_TRANSFORM_FEEDBACK_BUFFER, 0, out.size() * sizeof(float), out.data());
+
+    glDeleteBuffers(1, &tbo);
+    glDeleteVertexArrays(1, &vao);
+    return out;
+}
+
+// Evaluate on the GPU: fPos and fNorm of the vertices. defs select the variant of
+// the shader, values are the (re, im) pairs of a heightfield evaluated at every
+// stride-th point.
+static vector<float> gpuEval(const string& defs, bool imag, const vector<float>& values = {}, int stride = 1)
+{
+    Shader shader("graph_vertex.glsl", "graph_frag.glsl");
+    shader.init(defs, { "fPos", "fNorm" });
+    if (!shader.ok())
+        return {};
+
+    FloatTexture heightfield;
+    if (!values.empty()) {
+        heightfield.init();
+        heightfield.buffer(values.data(), res, res);
+        heightfield.use(shader, "values");
+        shader.uniform("gridStride", stride);
+    }
+    return capture(shader, imag);
+}
+
+// Draw the values of program on the grid as a heightfield, return the number of
+// points where the positions or the normals from the neighbours differ. A stride
+// > 1 checks the coarse level of every stride-th point.
+static int testHeightfield(const Program<MyT>& program, int stride)
+{
+    vector<float> values(2 * res * res);
+    for (int k=0; k < res * res; ++k) {
+        float x = centerX - axisLength + float(k % res) * step, y = centerY - axisLength + float(k / res) * step;
+        MyT vars[] = { x, y, MyT(x, y) }, out[3];
+        program(vars, out);
+        values[2*k] = (float)out[0].real();
+        values[2*k + 1] = (float)out[0].imag();
+    }
+    for (float& v : values) // GPUs may flush denormals to zero
+        if (abs(v) < numeric_limits<float>::min())
+            v = 0.0f;
+
+    vector<float> re = gpuEval("#define HEIGHTFIELD\n", false, values, stride);
+    vector<float> im = gpuEval("#define HEIGHTFIELD\n", true, values, stride);
+    if (re.empty() || im.empty())
+        return res * res;
+
+    auto same = [](float a, float b) { return a == b || (isnan(a) && isnan(b)); };
+    const int last = (res - 1) / stride * stride;
+    int bad = 0;
+    for (int j=0; j < res; j += stride) {
+        for (int i=0; i < res; i += stride) {
+            const int k = i + j * res;
+            const int i0 = max(i - stride, 0), i1 = min(i + stride, last), j0 = max(j - stride, 0), j1 = min(j + stride, last);
+            bool ok = re[6*k] == im[6*k] && re[6*k + 1] == im[6*k + 1];
+            for (int part=0; part < 2; ++part) {
+                const float* gpu = part ? &im[6*k] : &re[6*k];
+                auto v = [&](int i, int j) { return values[2 * (i + j * res) + part]; };
+                float dx = slope((v(i1, j) - v(i0, j)) / (float(i1 - i0) * step));
+                float dy = slope((v(i, j1) - v(i, j0)) / (float(j1 - j0) * step));
+                float n = sqrt(dx * dx + dy * dy + 1.0f);
+                ok = ok && same(gpu[2], v(i, j)) && abs(gpu[3] - dx / n) < 1e-3f
+                        && abs(gpu[4] - dy / n) < 1e-3f && abs(gpu[5] - 1.0f / n) < 1e-3f;
+            }
+            bad += !ok;
+        }
+    }
+    return bad;
+}
+
+// Draw the grid from a ring buffer with the offsets, like a panned graph of the
+// canvas. Return the number of points not drawn from the vertex of their slot.
+static int testRing(int offsetX, int offsetY)
+{
+    Shader shader("graph_vertex.glsl", "graph_frag.glsl");
+    shader.init("#define RING_BUFFER\n", { "fPos", "fNorm" });
+    if (!shader.ok())
+        return res * res;
+
+    // Vertex of point (i, j) at its slot, with the column and row as value and slopes
+    vector<float> vertices(8 * res * res);
+    for (int j=0; j < res; ++j) {
+        for (int i=0; i < res; ++i) {
+            float* v = &vertices[8 * ((i + offsetX) % res + (j + offsetY) % res * res)];
+            const float vertex[] = { centerX - axisLength + float(i) * step, centerY - axisLength + float(j) * step,
+                                     float(i), float(j), float(i) / res, float(j) / res, 0.0f, 0.0f };
+            copy(vertex, vertex + 8, v);
+        }
+    }
+    GLuint buffer;
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STATIC_DRAW);
+    BufferTexture ring;
+    ring.init();
+    ring.buffer(buffer);
+    ring.use(shader, "vertices");
+    shader.uniform("gridOffset", glm::ivec2(offsetX, offsetY));
+    vector<float> out = capture(shader, false);
+    glDeleteBuffers(1, &buffer);
+
+    int bad = 0;
+    for (int k=0; k < res * res; ++k) {
+        const int i = k % res, j = k / res;
+        const float x = centerX - axisLength + float(i) * step, y = centerY - axisLength + float(j) * step;
+        const float dx = float(i) / res, dy = float(j) / res, n = sqrt(dx * dx + dy * dy + 1.0f);
+        const float* gpu = &out[6*k];
+        bad += !(gpu[0] == x && gpu[1] == y && gpu[2] == float(i) && abs(gpu[3] - dx / n) < 1e-5f
+                 && abs(gpu[4] - dy / n) < 1e-5f && abs(gpu[5] - 1.0f / n) < 1e-5f);
+    }
+    return bad;
+}
+
+// Compare GPU and CPU on the grid, return true if they agree
+static bool test(const string& s)
+{
+    cout << s << ": ";
+    Expr<MyT> expr(s);
+    expr.bind(exprVars, exprConsts);
+    Program<MyT> program(expr, exprRealVars, exprGradients);
+    Glsl<MyT> glsl(expr, glslSignature, glslVars);
+
+    const string defs = "#define EVAL_ON_GPU\n" + Glsl<MyT>::library + glsl.code();
+    vector<float> re = gpuEval(defs, false), im = gpuEval(defs, true);
+    if (re.empty() || im.empty()) {
+        cout << "FAILED, the shader does not compile" << endl << glsl.code();
+        return false;
+    }
+
+    double maxValue = 0.0, maxNormal = 0.0;
+    int bad = 0, checked = 0;
+    for (int k=0; k < res * res; ++k) {
+        // Same grid point as the shader
+        float x = centerX - axisLength + float(k % res) * step, y = centerY - axisLength + float(k / res) * step;
+        MyT values[] = { x, y, MyT(x, y) }, out[3];
+        program(values, out);
+        if (!isfinite(abs(out[0])) || abs(out[0]) > 1e6 || !isfinite(abs(out[1])) || !isfinite(abs(out[2])))
+            continue;
+        ++checked;
+
+        // Value, and normals of the real and imaginary part
+        const float* gpu[] = { &re[6*k], &im[6*k] };
+        double cpu[] = { out[0].real(), out[0].imag() };
+        double dx[] = { out[1].real(), out[1].imag() }, dy[] = { out[2].real(), out[2].imag() };
+        bool ok = gpu[0][0] == x && gpu[0][1] == y;
+        for (int part=0; part < 2; ++part) {
+            double e = abs(gpu[part][2] - cpu[part]) / (1.0 + abs(cpu[part]));
+            double n = sqrt(dx[part] * dx[part] + dy[part] * dy[part] + 1.0);
+            double en = max({ abs(gpu[part][3] + dx[part] / n), abs(gpu[part][4] + dy[part] / n), abs(gpu[part][5] - 1.0 / n) });
+            maxValue = max(maxValue, e);
+            maxNormal = max(maxNormal, en);
+            ok = ok && e < 1e-3 && en < 1e-2;
+        }
+        if (!ok && bad++ == 0)
+            cout << endl << "  at (" << x << ", " << y << "): GPU " << MyT(gpu[0][2], gpu[1][2])
+                 << ", CPU " << out[0] << endl << "  ";
+    }
+
+    cout << glsl.lines() << " lines of GLSL, " << checked << " points, max error " << maxValue
+         << " (value), " << maxNormal << " (normal)";
+    if (bad)
+        cout << ", FAILED at " << bad << " points";
+    int badHeightfield = testHeightfield(program, 1) + testHeightfield(program, 2);
+    if (badHeightfield)
+        cout << ", heightfield FAILED at " << badHeightfield << " points";
+    cout << endl;
+    return !bad && !badHeightfield;
+}
+
+int main(int argc, char** argv)
+{
+    registerFunctions();
+    if (!initContext()) {
+        cerr << "No OpenGL 3.3 context" << endl;
+        return -1;
+    }
+    cout << "Renderer: " << glGetString(GL_RENDERER) << endl;
+
+    vector<string> exprs(examples, examples + sizeof(examples) / sizeof(*examples));
+    exprs.insert(exprs.end(), argv + 1, argv + argc);
+
+    int failed = 0;
+    const int offsets[][2] = { { 0, 0 }, { 5, 17 }, { res - 1, 1 } };
+    for (const auto& o : offsets) {
+        const int bad = testRing(o[0], o[1]);
+        cout << "Ring buffer at offsets (" << o[0] << ", " << o[1] << "): ";
+        if (bad)
+            cout << "FAILED at " << bad << " points" << endl;
+        else
+            cout << "ok" << endl;
+        failed += bad > 0;
+    }
+    for (const string& s : exprs) {
+        try {
+            failed += !test(s);
+        } catch (const std::invalid_argument& e) {
+            cout << e.what() << endl;
+            ++failed;
+        }
+    }
+    return failed;
+}
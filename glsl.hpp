@@ -0,0 +1,245 @@
+/*
+ * File: glsl.hpp
+ * --------------
+ *
+ * Defines a template class that translates a bound Expr into a GLSL function,
+ * so the graph can be evaluated on the GPU. Complex values are vec2 (re, im)
+ * in single precision, the operations and functions are implemented in
+ * Glsl::library. Every node of the expression becomes one statement.
+ *
+ * Functions are translated if they name their GLSL version (Function::glsl).
+ * Powers with constant exponents take the same special cases as Program:
+ * small integer exponents are expanded into multiplications (binary
+ * exponentiation, no loops for the shader compiler to unroll), other real
+ * exponents use the polar form.
+ *
+ * The CPU evaluation (Program) stays the reference, the GLSL version agrees
+ * with it up to single precision rounding.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <cmath>
+#include <stdexcept>
+#include "expr.hpp"
+
+template <class T>
+class Glsl
+{
+public:
+    using R = typename Expr<T>::R;
+
+    // Complex arithmetic and the functions named in Function::glsl
+    inline static const std::string library = R"(
+vec2 cmul(vec2 a, vec2 b) { return vec2(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x); }
+
+vec2 cdiv(vec2 a, vec2 b)
+{
+    float s = max(abs(b.x), abs(b.y)); // Scaled against overflow of |b|^2
+    a /= s;
+    b /= s;
+    return vec2(a.x * b.x + a.y * b.y, a.y * b.x - a.x * b.y) / dot(b, b);
+}
+
+vec2 cexp(vec2 a) { return exp(a.x) * vec2(cos(a.y), sin(a.y)); }
+vec2 clog(vec2 a) { return vec2(log(length(a)), atan(a.y, a.x)); }
+
+vec2 cpow(vec2 a, vec2 b) { return a == vec2(0.0) ? vec2(0.0) : cexp(cmul(b, clog(a))); }
+
+vec2 cpowr(vec2 a, float r)
+{
+    if (a.y == 0.0 && a.x > 0.0)
+        return vec2(pow(a.x, r), 0.0);
+    if (a == vec2(0.0) && r > 0.0)
+        return vec2(0.0);
+    vec2 l = clog(a);
+    return exp(r * l.x) * vec2(cos(r * l.y), sin(r * l.y));
+}
+
+vec2 csqrt(vec2 a)
+{
+    float r = length(a);
+    if (r == 0.0)
+        return vec2(0.0);
+    float t = sqrt(0.5 * (r + abs(a.x)));
+    if (a.x >= 0.0)
+        return vec2(t, 0.5 * a.y / t);
+    return vec2(0.5 * abs(a.y) / t, a.y < 0.0 ? -t : t);
+}
+
+vec2 csin(vec2 a) { return vec2(sin(a.x) * cosh(a.y), cos(a.x) * sinh(a.y)); }
+vec2 ccos(vec2 a) { return vec2(cos(a.x) * cosh(a.y), -sin(a.x) * sinh(a.y)); }
+
+vec2 ctan(vec2 a)
+{
+    if (abs(a.y) > 20.0) // tanh(2 im) is +-1
+        return vec2(0.0, sign(a.y));
+    return vec2(sin(2.0 * a.x), sinh(2.0 * a.y)) / (cos(2.0 * a.x) + cosh(2.0 * a.y));
+}
+
+// asin(a) = -i log(ia + sqrt(1 - a^2)), odd, computed for re(a) >= 0 without cancellation
+vec2 casin(vec2 a)
+{
+    float s = a.x < 0.0 ? -1.0 : 1.0;
+    a *= s;
+    vec2 l = clog(vec2(-a.y, a.x) + csqrt(vec2(1.0, 0.0) - cmul(a, a)));
+    return s * vec2(l.y, -l.x);
+}
+
+vec2 cacos(vec2 a) { return vec2(1.57079632679, 0.0) - casin(a); }
+
+// atan(a) = i/2 (log(1 - ia) - log(1 + ia))
+vec2 catan(vec2 a)
+{
+    vec2 p = vec2(1.0 + a.y, -a.x), q = vec2(1.0 - a.y, a.x);
+    return 0.5 * vec2(atan(q.y, q.x) - atan(p.y, p.x), log(length(p) / length(q)));
+}
+
+vec2 cabs(vec2 a) { return vec2(length(a), 0.0); }
+vec2 cre(vec2 a) { return vec2(a.x, 0.0); }
+vec2 cim(vec2 a) { return vec2(a.y, 0.0); }
+vec2 cconj(vec2 a) { return vec2(a.x, -a.y); }
+vec2 cmax(vec2 a, vec2 b) { return a.x > b.x ? a : b; }
+vec2 cmin(vec2 a, vec2 b) { return a.x < b.x ? a : b; }
+)";
+
+    // Translate a bound expression into the GLSL function given by signature
+    // (like "vec2 f(float x, float y)"), vars holds the GLSL value of each
+    // variable in the order of binding. Throws invalid_argument for unbound
+    // variables and functions without a GLSL version.
+    Glsl(const Expr<T>& expr, const std::string& signature, const std::vector<std::string>& vars)
+    {
+        std::ostringstream out;
+        out << signature << "\n{\n";
+
+        // Value of each node, a variable name or an inlined literal
+        std::vector<std::string> v(expr.nodes.size());
+        for (size_t k=1; k <= v.size(); ++k) {
+            const int32_t i = k % v.size(); // The root comes last
+            v[i] = value(expr, i, v, vars, out);
+        }
+        out << "    return " << v[0] << ";\n}\n";
+        source = out.str();
+    }
+
+    const std::string& code() const { return source; }
+    size_t lines() const { return numLines; }
+
+private:
+    static const int MAX_POWER = 64; // Largest integer exponent expanded into multiplications, as in Program
+
+    std::string source;
+    size_t numLines = 0; // Statements in the function
+
+    // GLSL float literal of x
+    static std::string literal(R x)
+    {
+        if (std::isnan(x))
+            return "uintBitsToFloat(0x7fc00000u)";
+        if (std::isinf(x))
+            return x > 0 ? "uintBitsToFloat(0x7f800000u)" : "uintBitsToFloat(0xff800000u)";
+
+        std::ostringstream s;
+        s << std::setprecision(9) << x;
+        std::string r = s.str();
+        if (r.find_first_of(".e") == std::string::npos)
+            r += ".0";
+        return r;
+    }
+
+    static std::string literal(const T& x) { return "vec2(" + literal(std::real(x)) + ", " + literal(std::imag(x)) + ")"; }
+
+    // Follow pass-through nodes to a constant leaf, returns false if node k is not constant
+    static bool constant(const Expr<T>& expr, int32_t k, T& c)
+    {
+        while (true) {
+            const auto& e = expr.nodes[k];
+            if (e.op || e.slot >= 0 || e.func)
+                return false;
+            if (e.left < 0) {
+                c = e.value;
+                return !e.length;
+            }
+            k = e.left;
+        }
+    }
+
+    // Add a statement computing rhs, return its variable
+    std::string statement(const std::string& rhs, std::ostringstream& out)
+    {
+        std::string name = "v" + std::to_string(numLines++);
+        out << "    vec2 " << name << " = " << rhs << ";\n";
+        return name;
+    }
+
+    // Return the GLSL value of x^n for an integer n, |n| <= MAX_POWER
+    std::string power(std::string x, R n, std::ostringstream& out)
+    {
+        if (n == 0)
+            return literal(T(1));
+
+        std::string r;
+        for (int k = (int)std::abs(n); ; k >>= 1) {
+            if (k & 1)
+                r = r.empty() ? x : statement("cmul(" + r + ", " + x + ")", out);
+            if (k == 1)
+                break;
+            x = statement("cmul(" + x + ", " + x + ")", out);
+        }
+        if (n < 0)
+            r = statement("cdiv(vec2(1.0, 0.0), " + r + ")", out);
+        return r;
+    }
+
+    // Return the GLSL value of node k, v holds the values of its children
+    std::string value(const Expr<T>& expr, int32_t k, const std::vector<std::string>& v,
+                      const std::vector<std::string>& vars, std::ostringstream& out)
+    {
+        const auto& e = expr.nodes[k];
+
+        if (e.op) {
+            const std::string &a = v[e.left], &b = v[e.right];
+            switch (e.op) {
+                case '+': return statement(a + " + " + b, out);
+                case '-': return statement(a + " - " + b, out);
+                case '*': return statement("cmul(" + a + ", " + b + ")", out);
+                case '/': return statement("cdiv(" + a + ", " + b + ")", out);
+            }
+
+            T c;
+            if (!constant(expr, e.right, c) || std::imag(c) != 0)
+                return statement("cpow(" + a + ", " + b + ")", out);
+            const R n = std::real(c);
+            if (std::abs(n) > MAX_POWER || n != std::floor(n))
+                return statement("cpowr(" + a + ", " + literal(n) + ")", out);
+            return power(a, n, out);
+        }
+
+        if (e.slot >= 0) {
+            if ((size_t)e.slot >= vars.size())
+                throw std::invalid_argument("Error: Variable '" + std::string(expr.name(e)) + "' has no GLSL value.");
+            return vars[e.slot];
+        }
+
+        if (e.func) {
+            const auto& f = *e.func;
+            if (!f.glsl)
+                throw std::invalid_argument("Error: Function '" + std::string(expr.name(e)) + "' has no GLSL version.");
+            const auto& args = expr.nodes[e.left];
+            if (f.arity() == 1)
+                return statement(std::string(f.glsl) + "(" + v[args.left] + ")", out);
+            return statement(std::string(f.glsl) + "(" + v[args.left] + ", " + v[args.right] + ")", out);
+        }
+
+        if (e.length)
+            throw std::invalid_argument("Error: Variable '" + std::string(expr.name(e)) + "' is undefined.");
+
+        if (e.left >= 0)
+            return v[e.left];
+
+        return literal(e.value);
+    }
+};
@@ -1,7 +1,26 @@
 #version 330 core
 
+#if defined(EVAL_ON_GPU) || defined(HEIGHTFIELD)
+// Point gl_VertexID of a resolution x resolution grid, f(x, y) (see glsl.hpp) is inserted above
+// for EVAL_ON_GPU, HEIGHTFIELD reads the values of f at the grid points from a texture
+uniform int resolution;
+uniform float gridLength; // axisLength of the grid's evaluation
+uniform vec2 gridCenter;  // The grid covers gridCenter +- gridLength
+#ifdef HEIGHTFIELD
+uniform sampler2D values; // RG32F, (re, im) of f
+uniform int gridStride;   // Only every gridStride-th texel is evaluated yet
+#endif
+#elif defined(RING_BUFFER)
+// Vertices of a resolution x resolution grid in a ring buffer: point gl_VertexID
+// = i + j * resolution is stored at slot (i + gridOffset.x) % resolution +
+// (j + gridOffset.y) % resolution * resolution, as the texels vPos and vNorm
+uniform int resolution;
+uniform ivec2 gridOffset;
+uniform samplerBuffer vertices; // RGBA32F, two texels per vertex
+#else
 in vec4 vPos;
 in vec4 vNorm;
+#endif
 
 out vec3 fPos, fNorm;
 out vec3 fColor;
@@ -12,10 +31,55 @@ uniform float axisLength;
 uniform mat3 normal;
 uniform mat4 model, view, proj;
 
+#if defined(EVAL_ON_GPU) || defined(HEIGHTFIELD)
+// Slope for the normals, steep or undefined ones are clamped
+float slope(float d)
+{
+    return isnan(d) ? 0.0 : clamp(-d, -1e6, 1e6);
+}
+
+// Position and normals of the grid point, as Canvas::calcGraph computes them.
+// Derivatives are central differences over a step much smaller than the grid,
+// or over the neighbouring evaluated texels (one-sided at the edges) for HEIGHTFIELD.
+void evaluate(out vec4 vPos, out vec4 vNorm)
+{
+    int i = gl_VertexID % resolution, j = gl_VertexID / resolution;
+    float step = 2.0 * gridLength / float(resolution - 1);
+    float x = gridCenter.x - gridLength + float(i) * step;
+    float y = gridCenter.y - gridLength + float(j) * step;
+
+#ifdef EVAL_ON_GPU
+    float h = 0.01 * step;
+    vec2 value = f(x, y);
+    vec2 dx = (f(x + h, y) - f(x - h, y)) / (2.0 * h);
+    vec2 dy = (f(x, y + h) - f(x, y - h)) / (2.0 * h);
+#else
+    int last = (resolution - 1) / gridStride * gridStride;
+    int i0 = max(i - gridStride, 0), i1 = min(i + gridStride, last);
+    int j0 = max(j - gridStride, 0), j1 = min(j + gridStride, last);
+    vec2 value = texelFetch(values, ivec2(i, j), 0).rg;
+    vec2 dx = (texelFetch(values, ivec2(i1, j), 0).rg - texelFetch(values, ivec2(i0, j), 0).rg) / (float(i1 - i0) * step);
+    vec2 dy = (texelFetch(values, ivec2(i, j1), 0).rg - texelFetch(values, ivec2(i, j0), 0).rg) / (float(j1 - j0) * step);
+#endif
+
+    vPos = vec4(x, y, value);
+    vNorm = vec4(slope(dx.x), slope(dy.x), slope(dx.y), slope(dy.y));
+}
+#endif
+
 void main()
 {
     vec4 worldPos;
 
+#if defined(EVAL_ON_GPU) || defined(HEIGHTFIELD)
+    vec4 vPos, vNorm;
+    evaluate(vPos, vNorm);
+#elif defined(RING_BUFFER)
+    int i = gl_VertexID % resolution, j = gl_VertexID / resolution;
+    int slot = (i + gridOffset.x) % resolution + (j + gridOffset.y) % resolution * resolution;
+    vec4 vPos = texelFetch(vertices, 2 * slot), vNorm = texelFetch(vertices, 2 * slot + 1);
+#endif
+
     if (zIsImag) {
         // Imaginary (.w) component is the z-Axis
         float w = (min(1.0, max(-1.0, 2.0 * vPos.z / axisLength)) + 1.0) / 2.0;
@@ -34,4 +98,4 @@ void main()
 
     gl_Position = proj * view * worldPos;
     gl_ClipDistance[0] = min(axisLength - abs(vPos.z), axisLength - abs(vPos.w));
-}
\ No newline at end of file
+}
@@ -0,0 +1,248 @@
+/*
+ * File: gridfile.hpp
+ * ------------------
+ *
+ * Defines a class GridFile for evaluated grids on disk. A file starts with a
+ * Header (expression hash, domain, resolution), followed by the (re, im)
+ * float pairs of the resolution x resolution points, row by row, and, if
+ * the NORMALS flag is set, their slopes like GraphVertex::norm. These are
+ * exact derivatives, or differences of the neighbouring values if the
+ * DIFFERENCES flag is set too. Numbers are stored in the byte order of the
+ * machine.
+ *
+ * Opening a file maps it into memory, the values are read from the pages of
+ * the file. Archives compressed with zstd (path + ".zst", or any file starting
+ * with a zstd frame) are read and written too if built with WITH_ZSTD, they
+ * are decompressed into memory instead.
+ */
+
+#pragma once
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+class GridFile
+{
+public:
+    enum : uint32_t { NORMALS = 1, DIFFERENCES = 2 };
+
+    struct Header {
+        char magic[8] = { 'H', 'O', 'L', 'O', 'G', 'R', 'I', 'D' };
+        uint32_t version = VERSION;
+        uint32_t flags = 0;
+        uint64_t expr = 0;      // GridFile::hash of the expression
+        float centerX = 0.0f, centerY = 0.0f, axisLength = 0.0f; // The grid covers center +- axisLength
+        int32_t resolution = 0;
+
+        // Same grid as h, with at least its flags, and normals of the same kind
+        bool covers(const Header& h) const
+        {
+            const bool kind = !(h.flags & NORMALS) || (flags & DIFFERENCES) == (h.flags & DIFFERENCES);
+            return expr == h.expr && centerX == h.centerX && centerY == h.centerY && axisLength == h.axisLength
+                   && resolution == h.resolution && (flags & h.flags) == h.flags && kind;
+        }
+    };
+
+    // Hash of an expression, the same in each run (64 bit FNV-1a)
+    static uint64_t hash(const std::string& s)
+    {
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c : s)
+            h = (h ^ c) * 0x100000001b3ull;
+        return h;
+    }
+
+    // Open the grid at path, or its compressed archive, ok() is false if neither is valid
+    explicit GridFile(const std::string& path)
+    {
+        if (!open(path))
+            open(path + ".zst");
+    }
+
+    ~GridFile()
+    {
+        if (mapped)
+            munmap(mapped, bytes);
+    }
+
+    GridFile(const GridFile&) = delete;
+    GridFile& operator=(const GridFile&) = delete;
+
+    bool ok() const { return data != nullptr; }
+    bool compressed() const { return ok() && !mapped; }
+    size_t size() const { return bytes; }
+
+    const Header& header() const { return *(const Header*)data; }
+    const float* values() const { return (const float*)(data + sizeof(Header)); }
+
+    // nullptr without the NORMALS flag
+    const float* normals() const
+    {
+        return header().flags & NORMALS ? values() + 2 * points(header()) : nullptr;
+    }
+
+    // Offsets of the value and the normals of point k in the file, to write it in parts
+    static size_t valueOffset(size_t k) { return sizeof(Header) + 2 * k * sizeof(float); }
+    static size_t normalOffset(const Header& h, size_t k) { return sizeof(Header) + (2 * points(h) + 4 * k) * sizeof(float); }
+
+    // Write the grid of header: values, and normals if it has the NORMALS flag.
+    // Consecutive points are stride floats apart in both arrays (e.g. in an
+    // array of vertices), 0 if they are packed. The file is replaced at once,
+    // returns false if it can not be written.
+    static bool write(const std::string& path, const Header& header, const float* values, const float* normals,
+                      bool compress=false, size_t stride=0)
+    {
+        const std::string file = compress ? path + ".zst" : path, tmp = file + ".tmp";
+        FILE* f = std::fopen(tmp.c_str(), "wb");
+        if (!f)
+            return false;
+        const bool written = write(f, header, values, normals, compress, stride);
+        if (std::fclose(f) != 0 || !written || std::rename(tmp.c_str(), file.c_str()) != 0) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Write the grid to an open file (e.g. stdout), compressed needs WITH_ZSTD.
+    // Packed arrays are written or compressed from where they are, without a copy.
+    static bool write(FILE* f, const Header& header, const float* values, const float* normals,
+                      bool compress=false, size_t stride=0)
+    {
+        if (!compress) {
+            return pack(header, values, normals, stride, [&](const void* p, size_t size) {
+                return std::fwrite(p, 1, size, f) == size;
+            });
+        }
+#ifdef WITH_ZSTD
+        // Streamed through a small buffer, the frame has the content size for unpack()
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        if (!cctx)
+            return false;
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, ZSTD_LEVEL);
+        ZSTD_CCtx_setPledgedSrcSize(cctx, fileSize(header));
+        std::vector<char> out(ZSTD_CStreamOutSize());
+        auto deflate = [&](const void* p, size_t size, ZSTD_EndDirective end) {
+            ZSTD_inBuffer in = { p, size, 0 };
+            size_t left;
+            do {
+                ZSTD_outBuffer o = { out.data(), out.size(), 0 };
+                left = ZSTD_compressStream2(cctx, &o, &in, end);
+                if (ZSTD_isError(left) || std::fwrite(out.data(), 1, o.pos, f) != o.pos)
+                    return false;
+            } while (end == ZSTD_e_end ? left != 0 : in.pos < in.size);
+            return true;
+        };
+        const bool ok = pack(header, values, normals, stride, [&](const void* p, size_t size) {
+            return deflate(p, size, ZSTD_e_continue);
+        }) && deflate(nullptr, 0, ZSTD_e_end);
+        ZSTD_freeCCtx(cctx);
+        return ok;
+#else
+        return false;
+#endif
+    }
+
+private:
+    static const uint32_t VERSION = 1;
+    static const int ZSTD_LEVEL = 9;
+    static const size_t CHUNK = 4096; // Points gathered at once from strided arrays
+
+    const char* data = nullptr; // The file, nullptr if not valid
+    void* mapped = nullptr;     // Mapping of the file, nullptr if decompressed
+    size_t bytes = 0;
+    std::vector<char> unpacked; // Decompressed archive
+
+    static size_t points(const Header& h) { return (size_t)h.resolution * h.resolution; }
+    static size_t fileSize(const Header& h) { return sizeof(Header) + points(h) * sizeof(float) * (h.flags & NORMALS ? 6 : 2); }
+
+    // Pass the file to out(data, bytes) in parts: the header, and the values and
+    // normals at once if packed, else in chunks. Returns false if out does.
+    template <class F>
+    static bool pack(const Header& header, const float* values, const float* normals, size_t stride, F out)
+    {
+        const size_t n = points(header);
+        auto part = [&](const float* p, size_t floats) {
+            if (!stride || stride == floats)
+                return out(p, n * floats * sizeof(float));
+            std::vector<float> chunk(CHUNK * floats);
+            for (size_t k=0; k < n; k += CHUNK) {
+                const size_t m = std::min(CHUNK, n - k);
+                for (size_t i=0; i < m; ++i)
+                    std::copy_n(p + (k + i) * stride, floats, chunk.begin() + i * floats);
+                if (!out(chunk.data(), m * floats * sizeof(float)))
+                    return false;
+            }
+            return true;
+        };
+        return out(&header, sizeof(Header)) && part(values, 2) && (!(header.flags & NORMALS) || part(normals, 4));
+    }
+
+    // The header is valid and the size of the file matches it
+    static bool valid(const char* p, size_t size)
+    {
+        const Header h;
+        if (size < sizeof(Header))
+            return false;
+        const Header& f = *(const Header*)p;
+        if (std::memcmp(f.magic, h.magic, sizeof(h.magic)) || f.version != VERSION || f.resolution < 2)
+            return false;
+        return size == fileSize(f);
+    }
+
+    // Map the file, a zstd archive is decompressed
+    bool open(const std::string& path)
+    {
+        if (mapped)
+            munmap(mapped, bytes);
+        mapped = nullptr;
+
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // The mapping stays
+        if (p == MAP_FAILED)
+            return false;
+
+        mapped = p;
+        bytes = st.st_size;
+        if (valid((const char*)p, bytes)) {
+            data = (const char*)p;
+            return true;
+        }
+        return unpack();
+    }
+
+    bool unpack()
+    {
+#ifdef WITH_ZSTD
+        const unsigned long long size = ZSTD_getFrameContentSize(mapped, bytes);
+        if (size == ZSTD_CONTENTSIZE_UNKNOWN || size == ZSTD_CONTENTSIZE_ERROR || size < sizeof(Header))
+            return false;
+        unpacked.resize(size);
+        if (ZSTD_decompress(unpacked.data(), size, mapped, bytes) != size || !valid(unpacked.data(), size))
+            return false;
+        munmap(mapped, bytes);
+        mapped = nullptr;
+        bytes = size;
+        data = unpacked.data();
+        return true;
+#else
+        return false;
+#endif
+    }
+};
@@ -0,0 +1,436 @@
+/*
+ * File: jit.hpp
+ * -------------
+ *
+ * Defines a class that translates a compiled Program<complex<double> > into
+ * native x86-64 code for batch evaluation. Each run of arithmetic
+ * instructions becomes one loop over the block of points, computing four
+ * points at a time in AVX registers, so intermediate values stay in
+ * registers instead of going through the slot blocks. Variables, powers
+ * and function calls are left to Program::step, which calls the batch
+ * kernels or the functions of Expr, between these loops.
+ *
+ * The native code performs the same operations in the same order as
+ * Program::batch, so the results are identical. Without AVX or executable
+ * memory, compiled() is false and batch() runs the interpreter instead.
+ */
+
+#pragma once
+#include <complex>
+#include <vector>
+#include <algorithm>
+#include <initializer_list>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include "program.hpp"
+
+#if defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define JIT_X86_64
+#include <sys/mman.h>
+#endif
+
+class Jit
+{
+public:
+    using T = std::complex<double>;
+    using Instr = Program<T>::Instr;
+
+    // True if native code can run on this machine (x86-64 with AVX)
+    static bool available()
+    {
+#ifdef JIT_X86_64
+        return __builtin_cpu_supports("avx");
+#else
+        return false;
+#endif
+    }
+
+    // Constructor: Translate a copy of program, compiled() tells if this worked
+    Jit(const Program<T>& program) : program(program), fn(nullptr), codeSize(0)
+    {
+#ifdef JIT_X86_64
+        if (!available())
+            return;
+
+        translate();
+        void* mem = mmap(nullptr, out.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+            return;
+        memcpy(mem, out.data(), out.size());
+        if (mprotect(mem, out.size(), PROT_READ | PROT_EXEC) != 0) {
+            munmap(mem, out.size());
+            return;
+        }
+        fn = reinterpret_cast<Fn>(mem);
+        codeSize = out.size();
+        out = {};
+#endif
+    }
+
+    ~Jit()
+    {
+#ifdef JIT_X86_64
+        if (fn)
+            munmap(reinterpret_cast<void*>(fn), codeSize);
+#endif
+    }
+
+    // The native code refers to the instructions and constants of program
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    bool compiled() const { return fn != nullptr; }
+    size_t size() const { return codeSize; } // Bytes of native code
+
+    // Same as Program::batch
+    void batch(size_t n, const double* const* varsRe, const double* const* varsIm,
+               double* outRe, double* outIm) const
+    {
+        if (!fn) {
+            program.batch(n, varsRe, varsIm, outRe, outIm);
+            return;
+        }
+
+        const size_t block = Program<T>::BLOCK;
+        thread_local std::vector<double> slots;
+        if (slots.size() < 2 * block * program.slots())
+            slots.resize(2 * block * program.slots());
+
+        for (size_t start = 0; start < n; start += block) {
+            const size_t m = std::min(block, n - start);
+            Block b = { &program, slots.data(), start, m, (m + 3) / 4 * 4 * sizeof(double), varsRe, varsIm };
+            fn(&b);
+            program.output(start, m, n, slots.data(), outRe, outIm);
+        }
+    }
+
+private:
+    // Argument of the native code
+    struct Block {
+        const Program<T>* program;
+        double* slots;
+        size_t start, m;
+        size_t bytes; // Lanes run by the loops, m rounded up to whole registers
+        const double* const* varsRe;
+        const double* const* varsIm;
+    };
+
+    using Fn = void (*)(const Block*);
+    using OpCode = Program<T>::OpCode;
+
+    static const int NUM_REGS = 14; // ymm0 to ymm13 hold values, ymm14 and ymm15 are scratch
+    static const int T0 = 14, T1 = 15;
+
+    // AVX opcodes (map 0F, prefix 66)
+    enum { MOVUPD_LOAD = 0x10, MOVUPD_STORE = 0x11, MOVAPD = 0x28, XORPD = 0x57,
+           ADDPD = 0x58, MULPD = 0x59, SUBPD = 0x5C, DIVPD = 0x5E };
+
+    const Program<T> program;
+    Fn fn;
+    size_t codeSize;
+
+    // Translation state
+    std::vector<uint8_t> out;
+    std::vector<int> regOf; // Register of part 0 (re) and 1 (im) of each slot, -1 if in memory
+    int owner[NUM_REGS];    // 2 * slot + part held by a register, -1 if free
+    bool dirty[NUM_REGS];   // Register not yet stored to the slot block
+    unsigned lastUsed[NUM_REGS], clock;
+    unsigned pinned;        // Registers used by the current instruction
+
+    // Run instruction in on the block in the interpreter
+    static void step(const Instr* in, const Block* b)
+    {
+        b->program->step(*in, b->start, b->m, b->varsRe, b->varsIm, b->slots);
+    }
+
+    static bool native(OpCode op)
+    {
+        switch (op) {
+            case Program<T>::CONST: case Program<T>::ADD: case Program<T>::SUB:
+            case Program<T>::MUL: case Program<T>::DIV: case Program<T>::SQR:
+            case Program<T>::CPLX: case Program<T>::RADD: case Program<T>::RSUB:
+            case Program<T>::RMUL: case Program<T>::RDIV: case Program<T>::RSQR:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Machine code
+
+    void bytes(std::initializer_list<uint8_t> b) { out.insert(out.end(), b); }
+
+    void imm(uint64_t v, int n)
+    {
+        for (int i=0; i < n; ++i)
+            out.push_back(uint8_t(v >> (8 * i)));
+    }
+
+    // 3 byte VEX prefix of a 256 bit instruction with prefix 66, and its opcode
+    void vex(int map, uint8_t op, int r, int v, bool extendRm)
+    {
+        out.push_back(0xC4);
+        out.push_back((r < 8 ? 0x80 : 0) | 0x40 | (extendRm ? 0 : 0x20) | map);
+        out.push_back(((~v & 15) << 3) | 0x05);
+        out.push_back(op);
+    }
+
+    // op ymm r, ymm v, ymm rm
+    void avx(uint8_t op, int r, int v, int rm)
+    {
+        vex(1, op, r, v, rm >= 8);
+        out.push_back(0xC0 | (r & 7) << 3 | (rm & 7));
+    }
+
+    // Load or store ymm r at [r12 + rcx + disp]
+    void avxMem(uint8_t op, int r, int32_t disp)
+    {
+        vex(1, op, r, 0, true);
+        out.push_back(0x84 | (r & 7) << 3);
+        out.push_back(0x0C);
+        imm(uint32_t(disp), 4);
+    }
+
+    // vbroadcastsd ymm r, [p]
+    void broadcast(int r, const double* p)
+    {
+        bytes({ 0x48, 0xB8 }); // mov rax, p
+        imm(reinterpret_cast<uintptr_t>(p), 8);
+        vex(2, 0x19, r, 0, false);
+        out.push_back((r & 7) << 3);
+    }
+
+    // Byte offset of a part of a slot block
+    static int32_t offset(int slot, int part)
+    {
+        return int32_t((2 * Program<T>::BLOCK * slot + part * Program<T>::BLOCK) * sizeof(double));
+    }
+
+    // Register allocation within a loop
+
+    void pin(int r)
+    {
+        pinned |= 1u << r;
+        lastUsed[r] = ++clock;
+    }
+
+    // A free register, the least recently used one is spilled if necessary
+    int alloc()
+    {
+        int best = -1;
+        for (int r=0; r < NUM_REGS; ++r) {
+            if (pinned & (1u << r))
+                continue;
+            if (owner[r] < 0) {
+                pin(r);
+                return r;
+            }
+            if (best < 0 || lastUsed[r] < lastUsed[best])
+                best = r;
+        }
+        if (dirty[best])
+            avxMem(MOVUPD_STORE, best, offset(owner[best] / 2, owner[best] % 2));
+        regOf[owner[best]] = -1;
+        owner[best] = -1;
+        pin(best);
+        return best;
+    }
+
+    // Register holding a part of a slot, loaded if necessary
+    int load(int slot, int part)
+    {
+        int r = regOf[2 * slot + part];
+        if (r < 0) {
+            r = alloc();
+            avxMem(MOVUPD_LOAD, r, offset(slot, part));
+            owner[r] = 2 * slot + part;
+            regOf[2 * slot + part] = r;
+            dirty[r] = false;
+        }
+        pin(r);
+        return r;
+    }
+
+    // Register r now holds a part of a slot (-1 to drop the part)
+    void define(int slot, int part, int r)
+    {
+        int old = regOf[2 * slot + part];
+        if (old >= 0)
+            owner[old] = -1;
+        regOf[2 * slot + part] = r;
+        if (r >= 0) {
+            owner[r] = 2 * slot + part;
+            dirty[r] = true;
+        }
+    }
+
+    // True if the value of a slot is read at or after instruction k
+    bool neededFrom(int slot, size_t k) const
+    {
+        const auto& code = program.instructions();
+        for (; k < code.size(); ++k) {
+            const Instr& in = code[k];
+            if (in.code != Program<T>::CONST && in.code != Program<T>::VAR
+                && (in.a == slot || (Program<T>::binary(in.code) && in.b == slot)))
+                return true;
+            if (in.dst == slot)
+                return false;
+        }
+        const auto& res = program.resultSlots();
+        return std::find(res.begin(), res.end(), slot) != res.end();
+    }
+
+    // Store the registers needed from instruction k on, then forget all registers
+    void flush(size_t k)
+    {
+        for (int r=0; r < NUM_REGS; ++r) {
+            if (owner[r] >= 0 && dirty[r] && neededFrom(owner[r] / 2, k))
+                avxMem(MOVUPD_STORE, r, offset(owner[r] / 2, owner[r] % 2));
+            if (owner[r] >= 0)
+                regOf[owner[r]] = -1;
+            owner[r] = -1;
+        }
+    }
+
+    // Translate one arithmetic instruction
+    void arith(const Instr& in)
+    {
+        using P = Program<T>;
+        pinned = 0;
+
+        if (in.code == P::CONST) {
+            const double* c = reinterpret_cast<const double*>(&program.constants()[in.a]);
+            int re = alloc(), im = alloc();
+            broadcast(re, c);
+            broadcast(im, c + 1);
+            define(in.dst, 0, re);
+            define(in.dst, 1, im);
+            return;
+        }
+
+        int a0 = load(in.a, 0);
+        if (in.code >= P::RADD) {
+            int b0 = P::binary(in.code) ? load(in.b, 0) : a0;
+            int d = alloc();
+            switch (in.code) {
+                case P::RADD: avx(ADDPD, d, a0, b0); break;
+                case P::RSUB: avx(SUBPD, d, a0, b0); break;
+                case P::RMUL: avx(MULPD, d, a0, b0); break;
+                case P::RDIV: avx(DIVPD, d, a0, b0); break;
+                case P::RSQR: avx(MULPD, d, a0, a0); break;
+                default: break;
+            }
+            define(in.dst, 0, d);
+            define(in.dst, 1, -1);
+            return;
+        }
+
+        int d0, d1;
+        if (in.code == P::CPLX) {
+            d0 = alloc();
+            d1 = alloc();
+            avx(MOVAPD, d0, 0, a0);
+            avx(XORPD, d1, d1, d1);
+        } else {
+            int a1 = load(in.a, 1);
+            int b0 = P::binary(in.code) ? load(in.b, 0) : a0;
+            int b1 = P::binary(in.code) ? load(in.b, 1) : a1;
+            d0 = alloc();
+            d1 = alloc();
+            switch (in.code) {
+                case P::ADD:
+                    avx(ADDPD, d0, a0, b0);
+                    avx(ADDPD, d1, a1, b1);
+                    break;
+                case P::SUB:
+                    avx(SUBPD, d0, a0, b0);
+                    avx(SUBPD, d1, a1, b1);
+                    break;
+                case P::MUL: // re = a0 b0 - a1 b1, im = a0 b1 + a1 b0
+                    avx(MULPD, T0, a0, b0);
+                    avx(MULPD, T1, a1, b1);
+                    avx(SUBPD, d0, T0, T1);
+                    avx(MULPD, T0, a0, b1);
+                    avx(MULPD, T1, a1, b0);
+                    avx(ADDPD, d1, T0, T1);
+                    break;
+                case P::DIV: // re = (a0 b0 + a1 b1) / den, im = (a1 b0 - a0 b1) / den
+                    avx(MULPD, T0, b0, b0);
+                    avx(MULPD, T1, b1, b1);
+                    avx(ADDPD, T0, T0, T1);
+                    avx(MULPD, T1, a0, b0);
+                    avx(MULPD, d0, a1, b1);
+                    avx(ADDPD, d0, T1, d0);
+                    avx(DIVPD, d0, d0, T0);
+                    avx(MULPD, T1, a1, b0);
+                    avx(MULPD, d1, a0, b1);
+                    avx(SUBPD, d1, T1, d1);
+                    avx(DIVPD, d1, d1, T0);
+                    break;
+                case P::SQR: // re = a0^2 - a1^2, im = 2 a0 a1
+                    avx(MULPD, T0, a0, a0);
+                    avx(MULPD, T1, a1, a1);
+                    avx(SUBPD, d0, T0, T1);
+                    avx(ADDPD, T0, a0, a0);
+                    avx(MULPD, d1, T0, a1);
+                    break;
+                default:
+                    break;
+            }
+        }
+        define(in.dst, 0, d0);
+        define(in.dst, 1, d1);
+    }
+
+    // Generate the code of the program, called with the Block in rdi
+    void translate()
+    {
+        const auto& code = program.instructions();
+        regOf.assign(2 * program.slots(), -1);
+        std::fill(owner, owner + NUM_REGS, -1);
+        std::fill(lastUsed, lastUsed + NUM_REGS, 0);
+        clock = 0;
+
+        bytes({ 0x53, 0x41, 0x54, 0x41, 0x55 });    // push rbx, r12, r13
+        bytes({ 0x48, 0x89, 0xFB });                // mov rbx, rdi
+        bytes({ 0x4C, 0x8B, 0x63, uint8_t(offsetof(Block, slots)) }); // mov r12, [rbx + slots]
+        bytes({ 0x4C, 0x8B, 0x6B, uint8_t(offsetof(Block, bytes)) }); // mov r13, [rbx + bytes]
+
+        size_t loop = 0;
+        bool inLoop = false;
+        for (size_t k=0; k <= code.size(); ++k) {
+            bool arithmetic = k < code.size() && native(code[k].code);
+            if (inLoop && !arithmetic) {
+                flush(k);
+                bytes({ 0x48, 0x83, 0xC1, 0x20 });  // add rcx, 32
+                bytes({ 0x4C, 0x39, 0xE9 });        // cmp rcx, r13
+                bytes({ 0x0F, 0x82 });              // jb loop
+                imm(uint32_t(int32_t(loop - (out.size() + 4))), 4);
+                bytes({ 0xC5, 0xF8, 0x77 });        // vzeroupper
+                inLoop = false;
+            }
+            if (k == code.size())
+                break;
+
+            if (arithmetic) {
+                if (!inLoop) {
+                    bytes({ 0x31, 0xC9 });          // xor ecx, ecx
+                    loop = out.size();
+                    inLoop = true;
+                }
+                arith(code[k]);
+            } else {
+                bytes({ 0x48, 0xBF });              // mov rdi, &code[k]
+                imm(reinterpret_cast<uintptr_t>(&code[k]), 8);
+                bytes({ 0x48, 0x89, 0xDE });        // mov rsi, rbx
+                bytes({ 0x48, 0xB8 });              // mov rax, step
+                imm(reinterpret_cast<uintptr_t>(&Jit::step), 8);
+                bytes({ 0xFF, 0xD0 });              // call rax
+            }
+        }
+
+        bytes({ 0x41, 0x5D, 0x41, 0x5C, 0x5B });    // pop r13, r12, rbx
+        bytes({ 0xC3 });                            // ret
+    }
+};
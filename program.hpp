@@ -0,0 +1,803 @@
+/*
+ * File: program.hpp
+ * -----------------
+ *
+ * Defines a template class that compiles a parsed Expr into a flat, linear
+ * stream of instructions operating on numbered value slots. A small
+ * interpreter loop runs the program without recursion, pointer chasing
+ * or string work, which makes it suitable for evaluation on large grids.
+ * Variables are taken from the slots assigned by Expr::bind.
+ *
+ * While compiling, constant subtrees are folded and identical subtrees are
+ * merged (value numbering), so every shared value is computed only once.
+ * Powers with small integer exponents become chains of multiplications
+ * (binary exponentiation), real exponents use the cheaper pow(T, R).
+ * Slots are reused as soon as the value they hold is no longer needed.
+ *
+ * Values are also typed: real variables, real constants and functions with
+ * real results (see realFuncs) start subtrees that are provably real. These
+ * are computed in R and only promoted to T where a complex operation needs
+ * them, giving the same values (up to the sign of a zero imaginary part).
+ *
+ * For complex<R> the program can also run on batches of points given in
+ * structure-of-arrays layout. Each instruction is then applied to a whole
+ * block of points, so arithmetic runs in tight loops over real arrays that
+ * the compiler can vectorize. Real values only occupy the re block.
+ *
+ * Given the partial derivatives of the variables in x and y, the program
+ * also computes those of the expression (forward-mode differentiation of
+ * the instruction stream), as two more results. Changes are tracked along
+ * x only while a value is holomorphic in x + iy; by the Cauchy-Riemann
+ * equations its change along y is i times that along x.
+ */
+
+#pragma once
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <map>
+#include <tuple>
+#include <queue>
+#include <functional>
+#include "expr.hpp"
+
+template <class T>
+class Program
+{
+public:
+    using fp1 = typename Expr<T>::fp1;
+    using fp2 = typename Expr<T>::fp2;
+    using bfp1 = typename Expr<T>::bfp1;
+    using R = typename Expr<T>::R;
+    using rfp1 = R (*)(R);
+    using rfp2 = R (*)(R, R);
+
+    // Real 1-arg batch function type: n values of x to out, may work in place
+    using rbfp1 = void (*)(size_t, const R*, R*);
+
+    // Results known to be >= 0: never, always, if any argument is, if all arguments are
+    enum NonNeg { NEVER, ALWAYS, IF_ANY, IF_ALL };
+
+    // Real versions of the functions of Expr<T>, used for real arguments.
+    // They must return exactly the real part of the complex function there.
+    struct RealFunc {
+        rfp1 f1 = nullptr;       // Real version of a 1-arg function
+        rfp2 f2 = nullptr;       // Real version of a 2-arg function
+        rbfp1 bf1 = nullptr;     // Batch version of f1, may be nullptr
+        bool nonNegArgs = false; // f1, f2 only apply to arguments >= 0
+        bool realValued = false; // The complex function has real results for all arguments
+        NonNeg nonNeg = NEVER;
+    };
+
+    inline static std::map<std::string, RealFunc> realFuncs = {};
+
+    // Op codes starting with R have real operands and results
+    enum OpCode { CONST=0, VAR, ADD, SUB, MUL, DIV, POW, POWR, SQR, CALL1, CALL2, CPLX,
+                  RADD, RSUB, RMUL, RDIV, RPOW, RSQR, RCALL1, RCALL2 };
+
+    struct Instr {
+        OpCode code;
+        int dst;              // Slot receiving the result
+        int a, b = 0;         // Operand slots (or index of constant / variable)
+        fp1 f1 = nullptr;     // Function of CALL1
+        fp2 f2 = nullptr;     // Function of CALL2
+        bfp1 bf1 = nullptr;   // Batch version of f1, may be nullptr
+        rfp1 rf1 = nullptr;   // Function of RCALL1
+        rfp2 rf2 = nullptr;   // Function of RCALL2
+        rbfp1 rbf1 = nullptr; // Batch version of rf1, may be nullptr
+    };
+
+    static const size_t BLOCK = 256; // Points per block in batch evaluation
+
+    // Constructor: An empty program evaluating to zero
+    Program() : numSlots(1), numNodes(1), results{ 0 }, realResults{ false }
+    {
+        consts.push_back(T(0));
+        code.push_back({ CONST, 0, 0 });
+    }
+
+    // Constructor: Compile a bound expression, realVars lists the variables
+    // that are always real. Throws invalid_argument for unbound variables.
+    // If gradients holds the partial derivatives in x and y of each variable,
+    // the program has three results: the value and its partial derivatives.
+    // Throws invalid_argument then if a function has no derivative.
+    Program(const Expr<T>& expr, const std::vector<int>& realVars = {},
+            const std::vector<std::pair<T, T> >& gradients = {})
+        : numSlots(0), numNodes(0), realVars(realVars), gradients(gradients)
+    {
+        std::map<Key, int> values;
+        allocate(value(expr, values));
+    }
+
+    // Evaluate the program, vars holds the values in the order of binding
+    T operator()(const T* vars) const
+    {
+        return run(vars)[results[0]];
+    }
+
+    // Evaluate the program and write all results to out
+    void operator()(const T* vars, T* out) const
+    {
+        const T* s = run(vars);
+        for (size_t k=0; k < results.size(); ++k)
+            out[k] = s[results[k]];
+    }
+
+    // Evaluate the program on n points. Variable k of point i is given by
+    // varsRe[k][i] and varsIm[k][i], result k is written to outRe[k*n + i]
+    // and outIm[k*n + i]. Only available for T = complex<R>.
+    void batch(size_t n, const R* const* varsRe, const R* const* varsIm, R* outRe, R* outIm) const
+    {
+        thread_local std::vector<R> slots; // Re and im block of each slot
+        if (slots.size() < 2 * BLOCK * numSlots)
+            slots.resize(2 * BLOCK * numSlots);
+
+        for (size_t start = 0; start < n; start += BLOCK) {
+            const size_t m = std::min(BLOCK, n - start);
+            for (const Instr& in : code)
+                step(in, start, m, varsRe, varsIm, slots.data());
+            output(start, m, n, slots.data(), outRe, outIm);
+        }
+    }
+
+    // Apply an instruction to points start to start+m-1 of a batch evaluation,
+    // slots holds a block of BLOCK re and BLOCK im values for each slot
+    void step(const Instr& in, size_t start, size_t m,
+              const R* const* varsRe, const R* const* varsIm, R* slots) const
+    {
+        R* dRe = slots + 2 * BLOCK * in.dst;
+        R* dIm = dRe + BLOCK;
+        // Operand blocks, for CONST and VAR in.a is not a slot
+        const R* aRe = slots + (in.code > VAR ? 2 * BLOCK * in.a : 0);
+        const R* aIm = aRe + BLOCK;
+        const R* bRe = slots + 2 * BLOCK * in.b;
+        const R* bIm = bRe + BLOCK;
+
+        switch (in.code) {
+            case CONST:
+                std::fill(dRe, dRe + m, consts[in.a].real());
+                std::fill(dIm, dIm + m, consts[in.a].imag());
+                break;
+            case VAR:
+                std::copy(varsRe[in.a] + start, varsRe[in.a] + start + m, dRe);
+                std::copy(varsIm[in.a] + start, varsIm[in.a] + start + m, dIm);
+                break;
+            case ADD:
+                for (size_t i=0; i < m; ++i) {
+                    dRe[i] = aRe[i] + bRe[i];
+                    dIm[i] = aIm[i] + bIm[i];
+                }
+                break;
+            case SUB:
+                for (size_t i=0; i < m; ++i) {
+                    dRe[i] = aRe[i] - bRe[i];
+                    dIm[i] = aIm[i] - bIm[i];
+                }
+                break;
+            case MUL:
+                for (size_t i=0; i < m; ++i) {
+                    R re = aRe[i] * bRe[i] - aIm[i] * bIm[i];
+                    R im = aRe[i] * bIm[i] + aIm[i] * bRe[i];
+                    dRe[i] = re;
+                    dIm[i] = im;
+                }
+                break;
+            case DIV:
+                // Textbook formula, differs from operator/ only for inf / nan / overflow
+                for (size_t i=0; i < m; ++i) {
+                    R den = bRe[i] * bRe[i] + bIm[i] * bIm[i];
+                    R re = (aRe[i] * bRe[i] + aIm[i] * bIm[i]) / den;
+                    R im = (aIm[i] * bRe[i] - aRe[i] * bIm[i]) / den;
+                    dRe[i] = re;
+                    dIm[i] = im;
+                }
+                break;
+            case SQR:
+                // Same rounding as MUL of a value with itself
+                for (size_t i=0; i < m; ++i) {
+                    R re = aRe[i] * aRe[i] - aIm[i] * aIm[i];
+                    R im = 2 * aRe[i] * aIm[i];
+                    dRe[i] = re;
+                    dIm[i] = im;
+                }
+                break;
+            case CALL1:
+                if (in.bf1) {
+                    in.bf1(m, aRe, aIm, dRe, dIm);
+                    break;
+                }
+                [[fallthrough]];
+            case POW:
+            case POWR:
+            case CALL2:
+                for (size_t i=0; i < m; ++i) {
+                    T a(aRe[i], aIm[i]), b(bRe[i], bIm[i]), r;
+                    if (in.code == POW) r = pow(a, b);
+                    else if (in.code == POWR) r = pow(a, bRe[i]);
+                    else if (in.code == CALL1) r = in.f1(a);
+                    else r = in.f2(a, b);
+                    dRe[i] = r.real();
+                    dIm[i] = r.imag();
+                }
+                break;
+            case CPLX:
+                if (dRe != aRe)
+                    std::copy(aRe, aRe + m, dRe);
+                std::fill(dIm, dIm + m, R(0));
+                break;
+            case RADD:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = aRe[i] + bRe[i];
+                break;
+            case RSUB:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = aRe[i] - bRe[i];
+                break;
+            case RMUL:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = aRe[i] * bRe[i];
+                break;
+            case RDIV:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = aRe[i] / bRe[i];
+                break;
+            case RPOW:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = std::pow(aRe[i], bRe[i]);
+                break;
+            case RSQR:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = aRe[i] * aRe[i];
+                break;
+            case RCALL1:
+                if (in.rbf1) {
+                    in.rbf1(m, aRe, dRe);
+                    break;
+                }
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = in.rf1(aRe[i]);
+                break;
+            case RCALL2:
+                for (size_t i=0; i < m; ++i)
+                    dRe[i] = in.rf2(aRe[i], bRe[i]);
+                break;
+        }
+    }
+
+    // Copy the results of points start to start+m-1 of n from the slots to outRe, outIm
+    void output(size_t start, size_t m, size_t n, const R* slots, R* outRe, R* outIm) const
+    {
+        for (size_t k=0; k < results.size(); ++k) {
+            const R* res = slots + 2 * BLOCK * results[k];
+            std::copy(res, res + m, outRe + k * n + start);
+            if (realResults[k])
+                std::fill(outIm + k * n + start, outIm + k * n + start + m, R(0));
+            else
+                std::copy(res + BLOCK, res + BLOCK + m, outIm + k * n + start);
+        }
+    }
+
+    size_t size() const { return code.size(); }
+    size_t slots() const { return numSlots; }
+    size_t nodes() const { return numNodes; } // Size of the expression before optimization
+    const std::vector<Instr>& instructions() const { return code; }
+    const std::vector<T>& constants() const { return consts; }
+    size_t outputs() const { return results.size(); } // Number of results
+    const std::vector<int>& resultSlots() const { return results; }
+
+    // Instructions with operand b
+    static bool binary(OpCode op)
+    {
+        switch (op) {
+            case CONST: case VAR: case SQR: case CALL1: case CPLX: case RSQR: case RCALL1:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+private:
+    using Key = std::tuple<OpCode, int, int, std::string>; // Op code, operands, function name
+
+    static const int MAX_POWER = 64; // Largest integer exponent expanded into multiplications
+
+    std::vector<Instr> code;
+    std::vector<T> consts;
+    size_t numSlots;
+    size_t numNodes;
+    std::vector<int> results;      // Slots of the final values
+    std::vector<bool> realResults; // Final values that only have their re block
+
+    // Compile time only
+    std::vector<int> realVars;
+    std::vector<std::pair<T, T> > gradients; // Partial derivatives of the variables in x and y
+    std::vector<bool> isReal;   // Values known to have a zero imaginary part
+    std::vector<bool> isNonNeg; // Real values known to be >= 0 (or nan)
+    std::map<std::string, int> constIndex; // Index in consts by the bytes of a constant
+
+    // Run the program on one point and return its slots
+    const T* run(const T* vars) const
+    {
+        thread_local std::vector<T> slots; // Reused by all programs on this thread
+        if (slots.size() < numSlots)
+            slots.resize(numSlots);
+        T* s = slots.data();
+
+        for (const Instr& in : code) {
+            switch (in.code) {
+                case CONST:  s[in.dst] = consts[in.a]; break;
+                case VAR:    s[in.dst] = vars[in.a]; break;
+                case ADD:    s[in.dst] = s[in.a] + s[in.b]; break;
+                case SUB:    s[in.dst] = s[in.a] - s[in.b]; break;
+                case MUL:    s[in.dst] = s[in.a] * s[in.b]; break;
+                case DIV:    s[in.dst] = s[in.a] / s[in.b]; break;
+                case POW:    s[in.dst] = pow(s[in.a], s[in.b]); break;
+                case POWR:   s[in.dst] = pow(s[in.a], std::real(s[in.b])); break;
+                case SQR:    s[in.dst] = s[in.a] * s[in.a]; break;
+                case CALL1:  s[in.dst] = in.f1(s[in.a]); break;
+                case CALL2:  s[in.dst] = in.f2(s[in.a], s[in.b]); break;
+                case CPLX:   s[in.dst] = s[in.a]; break; // Real values are stored with zero imaginary part
+                case RADD:   s[in.dst] = std::real(s[in.a]) + std::real(s[in.b]); break;
+                case RSUB:   s[in.dst] = std::real(s[in.a]) - std::real(s[in.b]); break;
+                case RMUL:   s[in.dst] = std::real(s[in.a]) * std::real(s[in.b]); break;
+                case RDIV:   s[in.dst] = std::real(s[in.a]) / std::real(s[in.b]); break;
+                case RPOW:   s[in.dst] = std::pow(std::real(s[in.a]), std::real(s[in.b])); break;
+                case RSQR:   s[in.dst] = std::real(s[in.a]) * std::real(s[in.a]); break;
+                case RCALL1: s[in.dst] = in.rf1(std::real(s[in.a])); break;
+                case RCALL2: s[in.dst] = in.rf2(std::real(s[in.a]), std::real(s[in.b])); break;
+            }
+        }
+        return s;
+    }
+
+    // Values of real instructions are held as R, in the re block of their slot
+    static bool realOp(OpCode op) { return op >= RADD; }
+
+    // Evaluate a single instruction on operand values
+    static T apply(const Instr& in, const T& a, const T& b)
+    {
+        switch (in.code) {
+            case ADD:    return a + b;
+            case SUB:    return a - b;
+            case MUL:    return a * b;
+            case DIV:    return a / b;
+            case POW:    return pow(a, b);
+            case POWR:   return pow(a, std::real(b));
+            case SQR:    return a * a;
+            case CALL1:  return in.f1(a);
+            case CALL2:  return in.f2(a, b);
+            case RADD:   return T(std::real(a) + std::real(b));
+            case RSUB:   return T(std::real(a) - std::real(b));
+            case RMUL:   return T(std::real(a) * std::real(b));
+            case RDIV:   return T(std::real(a) / std::real(b));
+            case RPOW:   return T(std::pow(std::real(a), std::real(b)));
+            case RSQR:   return T(std::real(a) * std::real(a));
+            case RCALL1: return T(in.rf1(std::real(a)));
+            case RCALL2: return T(in.rf2(std::real(a), std::real(b)));
+            default:     return a;
+        }
+    }
+
+    // Return the number of the value of a constant, equal constants share one value
+    int constant(const T& v, std::map<Key, int>& values)
+    {
+        auto c = constIndex.emplace(std::string(reinterpret_cast<const char*>(&v), sizeof(T)), consts.size());
+        if (c.second)
+            consts.push_back(v);
+        return instr({ CONST, -1, c.first->second }, "", values);
+    }
+
+    // Return the number of the value computed by an instruction. Instructions
+    // on constants are folded, an instruction seen before returns its value.
+    // Calls of functions that are not pure are neither folded nor merged.
+    int instr(Instr in, const std::string& name, std::map<Key, int>& values, bool pure=true)
+    {
+        if (pure && in.code != CONST && in.code != VAR && code[in.a].code == CONST
+            && (!binary(in.code) || code[in.b].code == CONST)) {
+            T b = binary(in.code) ? consts[code[in.b].a] : T(0);
+            return constant(apply(in, consts[code[in.a].a], b), values);
+        }
+
+        // Commutative operations get a canonical operand order
+        if ((in.code == ADD || in.code == MUL || in.code == RADD || in.code == RMUL) && in.a > in.b)
+            std::swap(in.a, in.b);
+
+        Key key(in.code, in.a, in.b, name);
+        auto v = values.find(key);
+        if (pure && v != values.end())
+            return v->second;
+
+        // Type of the new value
+        auto rf = realFuncs.find(name);
+        bool real = false, nonNeg = false;
+        switch (in.code) {
+            case CONST:
+                real = std::imag(consts[in.a]) == 0;
+                nonNeg = real && std::real(consts[in.a]) >= 0;
+                break;
+            case VAR:
+                real = std::find(realVars.begin(), realVars.end(), in.a) != realVars.end();
+                break;
+            case CALL1:
+            case CALL2:
+                real = rf != realFuncs.end() && rf->second.realValued;
+                nonNeg = real && rf->second.nonNeg == ALWAYS;
+                break;
+            case CPLX:
+                real = true;
+                nonNeg = isNonNeg[in.a];
+                break;
+            case RADD:
+            case RMUL:
+            case RDIV:
+                real = true;
+                nonNeg = isNonNeg[in.a] && isNonNeg[in.b];
+                break;
+            case RPOW: // Only used for bases >= 0
+            case RSQR:
+                real = nonNeg = true;
+                break;
+            case RCALL1:
+            case RCALL2:
+                real = true;
+                switch (rf->second.nonNeg) {
+                    case NEVER:  break;
+                    case ALWAYS: nonNeg = true; break;
+                    case IF_ANY: nonNeg = isNonNeg[in.a] || (in.code == RCALL2 && isNonNeg[in.b]); break;
+                    case IF_ALL: nonNeg = isNonNeg[in.a] && (in.code == RCALL1 || isNonNeg[in.b]); break;
+                }
+                break;
+            default:
+                real = realOp(in.code);
+                break;
+        }
+        isReal.push_back(real);
+        isNonNeg.push_back(nonNeg);
+        code.push_back(in);
+        if (pure)
+            values[key] = code.size() - 1;
+        return code.size() - 1;
+    }
+
+    // Return value x as operand of a complex instruction, promoting real values
+    int complexValue(int x, std::map<Key, int>& values)
+    {
+        return realOp(code[x].code) ? instr({ CPLX, -1, x }, "", values) : x;
+    }
+
+    // Return the number of the value of an arithmetic operation (ADD to DIV),
+    // which is real if both operands are
+    int arith(OpCode op, int a, int b, std::map<Key, int>& values)
+    {
+        if (isReal[a] && isReal[b])
+            return instr({ OpCode(op - ADD + RADD), -1, a, b }, "", values);
+        return instr({ op, -1, complexValue(a, values), complexValue(b, values) }, "", values);
+    }
+
+    // Return the number of the value of x^y, where y is the value number of
+    // a constant. Small integer exponents are expanded by binary exponentiation.
+    int power(int x, int y, std::map<Key, int>& values)
+    {
+        const T& c = consts[code[y].a];
+        const R n = std::real(c);
+        if (std::imag(c) != 0)
+            return instr({ POW, -1, complexValue(x, values), y }, "", values);
+        if (n == 0)
+            return constant(T(1), values);
+        if (std::abs(n) > MAX_POWER || n != std::floor(n)) {
+            // pow(T, R) calls pow(R, R) for positive real bases, but returns nan for 0^-n
+            if (isNonNeg[x] && n > 0)
+                return instr({ RPOW, -1, x, y }, "", values);
+            return instr({ POWR, -1, complexValue(x, values), y }, "", values);
+        }
+
+        int r = -1;
+        for (int k = (int)std::abs(n); ; k >>= 1) {
+            if (k & 1)
+                r = r < 0 ? x : arith(MUL, r, x, values);
+            if (k == 1)
+                break;
+            x = isReal[x] ? instr({ RSQR, -1, x }, "", values)
+                          : instr({ SQR, -1, complexValue(x, values) }, "", values);
+        }
+        if (n < 0)
+            r = arith(DIV, constant(T(1), values), r, values);
+        return r;
+    }
+
+    // Add the instructions of all nodes, children before their parents, and
+    // return the numbers of the results: the value and, given gradients,
+    // its partial derivatives in x and y
+    std::vector<int> value(const Expr<T>& expr, std::map<Key, int>& values)
+    {
+        const bool derive = !gradients.empty();
+        std::vector<int> v(expr.nodes.size(), -1); // Values of the nodes
+        std::vector<Tangent> t(derive ? v.size() : 0);
+        for (size_t k=1; k <= v.size(); ++k) {
+            const int32_t i = k % v.size(); // The root comes last
+            v[i] = value(expr, i, v, values);
+            if (derive)
+                t[i] = tangent(expr, i, v, t, values);
+        }
+        if (!derive)
+            return { v[0] };
+
+        int dx = t[0].x, dy = alongY(t[0], values);
+        return { v[0], dx < 0 ? constant(T(0), values) : dx, dy < 0 ? constant(T(0), values) : dy };
+    }
+
+    // Add the instructions of node k, v holds the values of its children
+    int value(const Expr<T>& expr, int32_t k, const std::vector<int>& v, std::map<Key, int>& values)
+    {
+        const auto& e = expr.nodes[k];
+        const char* ops = "+-*/^";
+        const OpCode opCodes[] = { ADD, SUB, MUL, DIV, POW };
+        const char* op = e.op ? strchr(ops, e.op) : nullptr;
+
+        if (op) {
+            int a = v[e.left];
+            int b = v[e.right];
+            ++numNodes;
+            if (*op != '^')
+                return arith(opCodes[op - ops], a, b, values);
+            if (code[b].code == CONST)
+                return power(a, b, values);
+            return instr({ POW, -1, complexValue(a, values), complexValue(b, values) }, "", values);
+        }
+
+        if (e.slot >= 0) {
+            ++numNodes;
+            return instr({ VAR, -1, e.slot }, "", values);
+        }
+
+        if (e.func) {
+            const auto& f = *e.func;
+            const std::string name(expr.name(e));
+            auto rf = realFuncs.find(name);
+            const RealFunc* real = rf != realFuncs.end() ? &rf->second : nullptr;
+            // The real version applies to the arguments
+            auto realArgs = [&](int a, int b) {
+                return isReal[a] && isReal[b]
+                    && (!real->nonNegArgs || (isNonNeg[a] && isNonNeg[b]));
+            };
+
+            int a = v[expr.nodes[e.left].left];
+            ++numNodes;
+            if (f.arity() == 1) {
+                if (real && real->f1 && realArgs(a, a))
+                    return instr({ .code = RCALL1, .dst = -1, .a = a, .rf1 = real->f1, .rbf1 = real->bf1 },
+                                 name, values, f.pure);
+                return instr({ .code = CALL1, .dst = -1, .a = complexValue(a, values), .f1 = f.f1, .bf1 = f.bf1 },
+                             name, values, f.pure);
+            }
+            int b = v[expr.nodes[e.left].right];
+            if (real && real->f2 && realArgs(a, b))
+                return instr({ .code = RCALL2, .dst = -1, .a = a, .b = b, .rf2 = real->f2 }, name, values, f.pure);
+            return instr({ .code = CALL2, .dst = -1, .a = complexValue(a, values),
+                           .b = complexValue(b, values), .f2 = f.f2 }, name, values, f.pure);
+        }
+
+        if (e.length)
+            throw std::invalid_argument("Error: Variable '" + std::string(expr.name(e)) + "' is undefined.");
+
+        if (e.left >= 0)
+            return v[e.left];
+
+        ++numNodes;
+        return constant(e.value, values);
+    }
+
+    // Change of a value along x and along y as value numbers, -1 where it is zero.
+    // If holo, the change along y is i times the change along x and not computed.
+    struct Tangent {
+        int x = -1, y = -1;
+        bool holo = true;
+    };
+
+    // Arithmetic on changes, -1 stands for zero
+    int tmul(int a, int t, std::map<Key, int>& values) { return t < 0 ? -1 : arith(MUL, a, t, values); }
+    int tdiv(int t, int a, std::map<Key, int>& values) { return t < 0 ? -1 : arith(DIV, t, a, values); }
+    int tadd(int s, int t, OpCode op, std::map<Key, int>& values)
+    {
+        if (t < 0)
+            return s;
+        if (s < 0)
+            return op == ADD ? t : arith(SUB, constant(T(0), values), t, values);
+        return arith(op, s, t, values);
+    }
+
+    // Change along y
+    int alongY(const Tangent& t, std::map<Key, int>& values)
+    {
+        if (!t.holo || t.x < 0)
+            return t.y;
+        return arith(MUL, constant(sqrt(T(-1)), values), t.x, values);
+    }
+
+    // Change of a value computed from values with changes p and q, rule
+    // gives it from their changes along one direction. It is holomorphic if
+    // rule is complex differentiable and p, q are holomorphic.
+    template <class Rule>
+    Tangent combine(const Tangent& p, const Tangent& q, bool complexDiff, Rule rule, std::map<Key, int>& values)
+    {
+        Tangent r;
+        r.holo = complexDiff && p.holo && q.holo;
+        r.x = rule(p.x, q.x);
+        if (!r.holo)
+            r.y = rule(alongY(p, values), alongY(q, values));
+        return r;
+    }
+
+    static void conjugateBatch(size_t n, const R* re, const R* im, R* outRe, R* outIm)
+    {
+        for (size_t i=0; i < n; ++i) {
+            outRe[i] = re[i];
+            outIm[i] = -im[i];
+        }
+    }
+
+    static T logarithm(T x) { return log(x); }
+
+    // Add the instructions of the change of node k along x and y, v holds the
+    // values of the nodes and t the changes of its children
+    Tangent tangent(const Expr<T>& expr, int32_t k, const std::vector<int>& v,
+                    const std::vector<Tangent>& t, std::map<Key, int>& values)
+    {
+        const auto& e = expr.nodes[k];
+
+        if (e.op) {
+            const int a = v[e.left], b = v[e.right], r = v[k];
+            const Tangent &ta = t[e.left], &tb = t[e.right];
+            switch (e.op) {
+                case '+':
+                    return combine(ta, tb, true, [&](int p, int q) { return tadd(p, q, ADD, values); }, values);
+                case '-':
+                    return combine(ta, tb, true, [&](int p, int q) { return tadd(p, q, SUB, values); }, values);
+                case '*':
+                    return combine(ta, tb, true, [&](int p, int q) {
+                        return tadd(tmul(b, p, values), tmul(a, q, values), ADD, values);
+                    }, values);
+                case '/':
+                    return combine(ta, tb, true, [&](int p, int q) {
+                        return tdiv(tadd(p, tmul(r, q, values), SUB, values), b, values);
+                    }, values);
+            }
+
+            // Constant exponent c: c * a^(c-1)
+            if (code[b].code == CONST) {
+                const T c = consts[code[b].a];
+                if (c == T(0))
+                    return Tangent();
+                int d = arith(MUL, constant(c, values), power(a, constant(c - T(1), values), values), values);
+                return combine(ta, tb, true, [&](int p, int) { return tmul(d, p, values); }, values);
+            }
+
+            // a^b * (b' log(a) + b a' / a)
+            int ln = instr({ .code = CALL1, .dst = -1, .a = complexValue(a, values), .f1 = logarithm }, "(log)", values);
+            int ba = arith(DIV, b, a, values);
+            return combine(ta, tb, true, [&](int p, int q) {
+                return tmul(r, tadd(tmul(ln, q, values), tmul(ba, p, values), ADD, values), values);
+            }, values);
+        }
+
+        if (e.slot >= 0) {
+            Tangent r;
+            if ((size_t)e.slot >= gradients.size())
+                return r;
+            const auto& [gx, gy] = gradients[e.slot];
+            r.x = gx == T(0) ? -1 : constant(gx, values);
+            r.holo = gy == sqrt(T(-1)) * gx;
+            if (!r.holo)
+                r.y = gy == T(0) ? -1 : constant(gy, values);
+            return r;
+        }
+
+        if (e.func) {
+            const auto& f = *e.func;
+            const std::string name(expr.name(e));
+            if (!f.differentiable())
+                throw std::invalid_argument("Error: Function '" + name + "' has no derivative.");
+
+            const auto& args = expr.nodes[e.left];
+            const int a = complexValue(v[args.left], values);
+            const Tangent& ta = t[args.left];
+            if (f.arity() == 1) {
+                if (ta.x < 0 && (ta.holo || ta.y < 0))
+                    return Tangent();
+                int d = instr({ .code = CALL1, .dst = -1, .a = a, .f1 = f.df, .bf1 = f.bdf }, name + "'", values, f.pure);
+                if (!f.dfc)
+                    return combine(ta, ta, true, [&](int p, int) { return tmul(d, p, values); }, values);
+
+                // Not holomorphic: f' dz + f'c conj(dz)
+                int dc = instr({ .code = CALL1, .dst = -1, .a = a, .f1 = f.dfc }, name + "'c", values, f.pure);
+                return combine(ta, ta, false, [&](int p, int) {
+                    int cp = p < 0 ? -1 : instr({ .code = CALL1, .dst = -1, .a = complexValue(p, values),
+                                                  .f1 = Expr<T>::conjugate, .bf1 = conjugateBatch }, "(conj)", values);
+                    return tadd(tmul(d, p, values), tmul(dc, cp, values), ADD, values);
+                }, values);
+            }
+
+            const int b = complexValue(v[args.right], values);
+            const Tangent& tb = t[args.right];
+            int dx = instr({ .code = CALL2, .dst = -1, .a = a, .b = b, .f2 = f.dfx }, name + "'x", values, f.pure);
+            int dy = instr({ .code = CALL2, .dst = -1, .a = a, .b = b, .f2 = f.dfy }, name + "'y", values, f.pure);
+            return combine(ta, tb, true, [&](int p, int q) {
+                return tadd(tmul(dx, p, values), tmul(dy, q, values), ADD, values);
+            }, values);
+        }
+
+        if (e.left >= 0)
+            return t[e.left];
+        return Tangent();
+    }
+
+    // Drop instructions whose value is not needed and assign slots to the
+    // values. A slot is free again after the last use of its value.
+    void allocate(const std::vector<int>& res)
+    {
+        const int n = code.size();
+        std::vector<bool> live(n, false);
+        std::vector<int> lastUse(n, -1), slotOf(n, -1);
+        std::priority_queue<int, std::vector<int>, std::greater<int> > freeSlots; // Lowest on top
+        std::vector<Instr> out;
+
+        for (int r : res)
+            live[r] = true;
+        for (int k=n-1; k >= 0; --k) {
+            if (live[k] && code[k].code != CONST && code[k].code != VAR) {
+                live[code[k].a] = true;
+                if (binary(code[k].code))
+                    live[code[k].b] = true;
+            }
+        }
+        for (int k=0; k < n; ++k) {
+            if (live[k] && code[k].code != CONST && code[k].code != VAR) {
+                lastUse[code[k].a] = k;
+                if (binary(code[k].code))
+                    lastUse[code[k].b] = k;
+            }
+        }
+        for (int r : res)
+            lastUse[r] = n;
+
+        for (int k=0; k < n; ++k) {
+            if (!live[k])
+                continue;
+
+            Instr in = code[k];
+            if (in.code != CONST && in.code != VAR) {
+                int a = in.a, b = in.b;
+                in.a = slotOf[a];
+                if (lastUse[a] == k)
+                    freeSlots.push(slotOf[a]);
+                if (binary(in.code)) {
+                    in.b = slotOf[b];
+                    if (lastUse[b] == k && b != a)
+                        freeSlots.push(slotOf[b]);
+                }
+            }
+
+            // Take the lowest free slot, or a new one
+            if (!freeSlots.empty()) {
+                in.dst = freeSlots.top();
+                freeSlots.pop();
+            } else {
+                in.dst = numSlots++;
+            }
+            slotOf[k] = in.dst;
+            out.push_back(in);
+        }
+
+        results.clear();
+        realResults.clear();
+        for (int r : res) {
+            results.push_back(slotOf[r]);
+            realResults.push_back(realOp(code[r].code));
+        }
+        code = out;
+    }
+};
@@ -4,11 +4,14 @@
  *
  * Defines a Shader class that handles loading and compiling of a vertex
  * and fragment shader. Provides an overloaded function to manipulate
- * the shader's uniforms (to be amended as needed).
+ * the shader's uniforms (to be amended as needed). Variants of a vertex
+ * shader are made by inserting definitions after its #version line.
  */
 
 #pragma once
 #include <fstream>
+#include <string>
+#include <vector>
 #ifdef __APPLE__
     // We need this to query for the MacOS app bundle directory
     #include <CoreFoundation/CoreFoundation.h>
@@ -17,14 +20,24 @@
 class Shader
 {
 public:
-    Shader(const std::string& vertex_fname, const std::string& frag_fname) : ready(true), vertex_fname(vertex_fname), frag_fname(frag_fname) {}
+    Shader(const std::string& vertex_fname, const std::string& frag_fname) : program(0), ready(true), vertex_fname(vertex_fname), frag_fname(frag_fname) {}
 
-    void init()
+    // Compile and link, replacing a previous program. defs is inserted into the vertex
+    // shader after its #version line, feedback names vertex outputs to capture.
+    void init(const std::string& defs="", const std::vector<const char*>& feedback={})
     {
+        if (program)
+            glDeleteProgram(program);
+        program = 0;
+        ready = true;
+
         char *buffer = readFile(vertex_fname);
-        GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &buffer, NULL);
+        std::string source(buffer);
         delete [] buffer;
+        source.insert(source.find('\n') + 1, defs);
+        const char* vertexSource = source.c_str();
+        GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
+        glShaderSource(vertexShader, 1, &vertexSource, NULL);
 
         buffer = readFile(frag_fname);
         GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
@@ -42,6 +55,8 @@ public:
         glAttachShader(program, vertexShader);
         glAttachShader(program, fragmentShader);
         glBindFragDataLocation(program, 0, "outColor");
+        if (!feedback.empty())
+            glTransformFeedbackVaryings(program, feedback.size(), feedback.data(), GL_INTERLEAVED_ATTRIBS);
         glLinkProgram(program);
         checkShaderStatus();
 
@@ -93,6 +108,11 @@ public:
         glUniform2f(glGetUniformLocation(program, s.c_str()), v.x, v.y);
     }
 
+    void uniform(const std::string& s, const glm::ivec2& v) const
+    {
+        glUniform2i(glGetUniformLocation(program, s.c_str()), v.x, v.y);
+    }
+
 private:
     GLuint program;
     bool ready;
@@ -0,0 +1,206 @@
+/*
+ * File: tiles.hpp
+ * ---------------
+ *
+ * Defines a template class TileCache keeping evaluated samples of several
+ * expressions and views within a memory budget. The plane is divided into
+ * lattices of points k * step (or (k + 1/2) * step), and each lattice into
+ * tiles of TILE x TILE points, keyed by (expression hash, lattice, tile
+ * coordinates). A grid of the canvas lies on one lattice if its points do,
+ * so grids of the same step share the tiles they overlap, whatever their
+ * center and resolution.
+ *
+ * A tile holds the samples of the points evaluated so far, each with the
+ * content it has (the value, and the normals if computed). The least
+ * recently used tiles are dropped when the budget is exceeded.
+ */
+
+#pragma once
+#include <vector>
+#include <list>
+#include <map>
+#include <tuple>
+#include <mutex>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+
+template <class S>
+class TileCache
+{
+public:
+    static const int TILE = 32; // Points per row and column of a tile
+
+    // Content of a sample
+    enum : uint8_t { VALUE = 1, NORMAL = 2 };
+
+    // Position of a resolution x resolution grid in the cache
+    struct Grid {
+        size_t expr = 0;        // Hash of the expression
+        float step = 0.0f;      // 0 if the grid is on no lattice
+        int phaseX = 0, phaseY = 0; // Lattice points at (k + phase/2) * step
+        int64_t x0 = 0, y0 = 0; // Lattice point of grid point (0, 0)
+        int resolution = 0;
+    };
+
+    explicit TileCache(size_t budget) : budget_(budget) {}
+
+    // Grid of res points on centerX +- length and centerY +- length, with
+    // coordinates computed in single precision like Canvas::calcGraph
+    static Grid grid(size_t expr, int res, float centerX, float centerY, float length)
+    {
+        Grid g;
+        g.expr = expr;
+        g.resolution = res;
+        if (res < 2 || !(length > 0.0f))
+            return g;
+        const float step = 2.0f * length / (res-1);
+        if (align(centerX - length, step, g.phaseX, g.x0) && align(centerY - length, step, g.phaseY, g.y0))
+            g.step = step;
+        return g;
+    }
+
+    // Copy the samples of grid point (i, j) with the content from the cache,
+    // where wanted(i, j): take(i, j, sample). Returns the number of points.
+    template <class F, class G>
+    int lookup(const Grid& g, uint8_t content, F wanted, G take)
+    {
+        if (!g.step)
+            return 0;
+        std::lock_guard<std::mutex> lock(mutex);
+        int found = 0;
+        forTiles(g, [&](const Key& key, int64_t tx, int64_t ty) {
+            auto it = tiles.find(key);
+            if (it == tiles.end()) {
+                ++misses_;
+                return;
+            }
+            ++hits_;
+            Tile& tile = it->second;
+            order.splice(order.end(), order, tile.use);
+            forPoints(g, tx, ty, [&](int i, int j, int k) {
+                if ((tile.content[k] & content) == content && wanted(i, j)) {
+                    take(i, j, tile.samples[k]);
+                    ++found;
+                }
+            });
+        });
+        return found;
+    }
+
+    // Store the samples of the grid with the content: at(i, j, sample)
+    // returns false for a point without one
+    template <class F>
+    void store(const Grid& g, uint8_t content, F at)
+    {
+        if (!g.step)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        S sample;
+        forTiles(g, [&](const Key& key, int64_t tx, int64_t ty) {
+            auto it = tiles.find(key);
+            if (it == tiles.end()) {
+                it = tiles.emplace(key, Tile()).first;
+                Tile& tile = it->second;
+                tile.samples.resize(TILE * TILE);
+                tile.content.resize(TILE * TILE);
+                tile.use = order.insert(order.end(), key);
+                size_ += TILE_BYTES;
+            } else {
+                order.splice(order.end(), order, it->second.use);
+            }
+            Tile& tile = it->second;
+            forPoints(g, tx, ty, [&](int i, int j, int k) {
+                // A value without normals does not replace one with
+                if ((tile.content[k] & content) != content && at(i, j, sample)) {
+                    tile.samples[k] = sample;
+                    tile.content[k] = content;
+                }
+            });
+        });
+        evict();
+    }
+
+    void setBudget(size_t bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        budget_ = bytes;
+        evict();
+    }
+
+    // Bytes allowed and used, tiles found and not found by lookups
+    size_t budget() const { return locked(budget_); }
+    size_t size() const { return locked(size_); }
+    long hits() const { return locked(hits_); }
+    long misses() const { return locked(misses_); }
+
+private:
+    static const size_t TILE_BYTES = TILE * TILE * (sizeof(S) + 1);
+
+    // Expression, step, phases and tile coordinates
+    using Key = std::tuple<size_t, float, int, int, int64_t, int64_t>;
+
+    struct Tile {
+        std::vector<S> samples;       // Of point (u, v) at u + v * TILE
+        std::vector<uint8_t> content; // Of each sample, 0 for none
+        typename std::list<Key>::iterator use;
+    };
+
+    std::map<Key, Tile> tiles;
+    std::list<Key> order; // Least recently used first
+    size_t budget_, size_ = 0;
+    long hits_ = 0, misses_ = 0;
+    mutable std::mutex mutex;
+
+    // Read a member under the lock
+    template <class T>
+    T locked(const T& member) const
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return member;
+    }
+
+    // Lattice point of x, if within a small fraction of the step of one
+    static bool align(float x, float step, int& phase, int64_t& k)
+    {
+        const double h = 2.0 * x / step, r = std::round(h); // In half steps
+        if (std::abs(h - r) > 2e-3 || std::abs(r) > 1e15)
+            return false;
+        phase = std::abs(std::fmod(r, 2.0)) > 0.5;
+        k = (int64_t)((r - phase) / 2);
+        return true;
+    }
+
+    static int64_t tileOf(int64_t k) { return k >= 0 ? k / TILE : -((-k + TILE - 1) / TILE); }
+
+    // Call f(key, tx, ty) for each tile the grid overlaps
+    template <class F>
+    static void forTiles(const Grid& g, F f)
+    {
+        const int64_t last = g.resolution - 1;
+        for (int64_t ty = tileOf(g.y0); ty <= tileOf(g.y0 + last); ++ty)
+            for (int64_t tx = tileOf(g.x0); tx <= tileOf(g.x0 + last); ++tx)
+                f(Key(g.expr, g.step, g.phaseX, g.phaseY, tx, ty), tx, ty);
+    }
+
+    // Call f(i, j, k) for each grid point (i, j) in tile (tx, ty), at index k of the tile
+    template <class F>
+    static void forPoints(const Grid& g, int64_t tx, int64_t ty, F f)
+    {
+        const int64_t res = g.resolution;
+        const int i0 = std::max<int64_t>(0, tx * TILE - g.x0), i1 = std::min<int64_t>(res, (tx + 1) * TILE - g.x0);
+        const int j0 = std::max<int64_t>(0, ty * TILE - g.y0), j1 = std::min<int64_t>(res, (ty + 1) * TILE - g.y0);
+        for (int j=j0; j < j1; ++j)
+            for (int i=i0; i < i1; ++i)
+                f(i, j, (int)(g.x0 + i - tx * TILE) + (int)(g.y0 + j - ty * TILE) * TILE);
+    }
+
+    void evict()
+    {
+        while (size_ > budget_ && !order.empty()) {
+            tiles.erase(order.front());
+            order.pop_front();
+            size_ -= TILE_BYTES;
+        }
+    }
+};
@@ -0,0 +1,130 @@
+/*
+ * File: topology.hpp
+ * ------------------
+ *
+ * Defines a class GridTopology holding the indices to draw a resolution x
+ * resolution grid of vertices (vertex i + j * resolution at column i, row j):
+ * triangle strips separated by primitive restarts for the surface, and the
+ * edges of the grid as lines. The indices are 16 bit if the grid is small
+ * enough, 32 bit otherwise. A stride > 1 draws the coarser grid of every
+ * stride-th vertex, up to the last one it reaches in each direction. The
+ * indices do not depend on where the vertices are stored: the RING_BUFFER
+ * variant of graph_vertex.glsl maps them to the slots of a ring buffer.
+ *
+ * Both run through the grid in bands of BAND columns, row by row, so the
+ * vertices shared with the previous row are still in the GPU's post-transform
+ * cache. GridTopology::get caches the topologies of recent resolutions, and
+ * upload skips a vertex array that has the indices already.
+ */
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
+#include "buffers.hpp"
+
+class GridTopology
+{
+public:
+    explicit GridTopology(int resolution, int stride=1) : id(++count), resolution(resolution), stride(stride)
+    {
+        if (narrow())
+            build(strips16, lines16);
+        else
+            build(strips32, lines32);
+    }
+
+    // Topology of the resolution and stride, built on the first request
+    static const GridTopology& get(int resolution, int stride=1)
+    {
+        using Key = std::pair<int, int>;
+        static std::map<Key, std::unique_ptr<GridTopology> > cache;
+        static std::deque<Key> order; // Oldest first
+
+        const Key key(resolution, stride);
+        auto it = cache.find(key);
+        if (it != cache.end())
+            return *it->second;
+
+        if (order.size() == CACHE_SIZE) {
+            cache.erase(order.front());
+            order.pop_front();
+        }
+        order.push_back(key);
+        return *(cache[key] = std::make_unique<GridTopology>(resolution, stride));
+    }
+
+    // Indices fit in 16 bit, the largest one is left for the restarts
+    bool narrow() const { return resolution * resolution <= 0xffff; }
+
+    // Upload the indices for draws as GL_TRIANGLE_STRIP and GL_LINES, unless va has them
+    void upload(VertexArray& va) const
+    {
+        if (va.indexTag() == id)
+            return;
+        if (narrow()) {
+            va.elements(strips16, GL_TRIANGLE_STRIP);
+            va.elements(lines16, GL_LINES);
+        } else {
+            va.elements(strips32, GL_TRIANGLE_STRIP);
+            va.elements(lines32, GL_LINES);
+        }
+        va.setIndexTag(id);
+    }
+
+private:
+    static const int BAND = 16;       // Columns of cells per band, a strip covers 2 * (BAND + 1) vertices
+    static const size_t CACHE_SIZE = 8; // Two resolutions with their coarser levels
+
+    inline static uint64_t count = 0; // Topologies built so far
+    const uint64_t id;                // Tag of the indices in a VertexArray, unique
+    int resolution, stride;
+    std::vector<uint16_t> strips16, lines16;
+    std::vector<uint32_t> strips32, lines32;
+
+    template <class I>
+    void build(std::vector<I>& strips, std::vector<I>& lines) const
+    {
+        const int n = (resolution - 1) / stride; // Cells per row and column
+        const I restart = (I)-1;
+        auto idx = [&](int i, int j) { return (I)(i * stride + j * stride * resolution); };
+
+        const int bands = (n + BAND - 1) / BAND;
+        strips.reserve((size_t)n * (2 * n + 3 * bands));
+        lines.reserve((size_t)4 * n * (n + 1));
+
+        for (int i0=0; i0 < n; i0 += BAND) {
+            const int i1 = std::min(i0 + BAND, n); // Last column of the band
+
+            // A strip for each row of cells, with the same diagonals as two
+            // triangles (i,j), (i+1,j), (i,j+1) and (i,j+1), (i+1,j), (i+1,j+1)
+            for (int j=0; j < n; ++j) {
+                if (!strips.empty())
+                    strips.push_back(restart);
+                for (int i=i0; i <= i1; ++i) {
+                    strips.push_back(idx(i, j));
+                    strips.push_back(idx(i, j+1));
+                }
+            }
+
+            // Edges of the band: below each row, and the columns left of
+            // each vertex (the last band includes the rightmost column)
+            const int last = i1 == n ? i1 : i1 - 1;
+            for (int j=0; j <= n; ++j) {
+                for (int i=i0; i < i1; ++i) {
+                    lines.push_back(idx(i, j));
+                    lines.push_back(idx(i+1, j));
+                }
+                if (j < n) {
+                    for (int i=i0; i <= last; ++i) {
+                        lines.push_back(idx(i, j));
+                        lines.push_back(idx(i, j+1));
+                    }
+                }
+            }
+        }
+    }
+};
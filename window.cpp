@@ -37,6 +37,7 @@
 
 #include "window.h"
 #include "canvas.h"
+#include "functions.hpp"
 
 IMPLEMENT_APP(MyApp)
 
@@ -62,10 +63,12 @@ BEGIN_EVENT_TABLE(mainFrame, wxFrame)
     EVT_BUTTON(ID_BTN_PLOT,  mainFrame::OnButtonPlot)
     EVT_BUTTON(ID_BTN_CLEAR, mainFrame::OnButtonClear)
     EVT_CHOICE(ID_CH_STYLE,  mainFrame::OnChoiceStyle)
+    EVT_CHOICE(ID_CH_EVAL,   mainFrame::OnChoiceEval)
     EVT_CHECKBOX(ID_CB_IMAG, mainFrame::OnCheckBoxImag)
     EVT_SPINCTRL(ID_SP_RES,  mainFrame::OnSpinResolution)
 
     EVT_MENU(ID_MENU_LOG, mainFrame::OnMenuLog)
+    EVT_MENU(ID_MENU_CACHE, mainFrame::OnMenuCache)
     EVT_MENU(wxID_ABOUT,  mainFrame::OnMenuAbout)
     EVT_MENU(wxID_EXIT,   mainFrame::OnMenuQuit)
 END_EVENT_TABLE()
@@ -106,6 +109,7 @@ mainFrame::mainFrame(const wxString& title) : wxFrame(nullptr, wxID_ANY,  title,
     wxMenuBar* menuBar = new wxMenuBar;
     fileMenu->Append( wxID_ABOUT, "&About", "About the holomorphic 4D plotter" );
     fileMenu->Append( ID_MENU_LOG, "&Log", "Show log window" );
+    fileMenu->Append( ID_MENU_CACHE, "&Cache...", "Set the memory for evaluated points" );
     fileMenu->AppendSeparator();
     fileMenu->Append( wxID_EXIT, "&Quit", "Quit this app" );
     menuBar->Append( fileMenu, "&File" );
@@ -124,6 +128,7 @@ mainFrame::mainFrame(const wxString& title) : wxFrame(nullptr, wxID_ANY,  title,
     btnPlot   = new wxButton(   opSizerBox, ID_BTN_PLOT,  wxString("Plot") );
     cbImag    = new wxCheckBox( opSizerBox, ID_CB_IMAG,   wxString("Imaginary Z") );
     chStyle   = new wxChoice(   opSizerBox, ID_CH_STYLE,  wxDefaultPosition, wxDefaultSize, Canvas::graphStyleLabels );
+    chEval    = new wxChoice(   opSizerBox, ID_CH_EVAL,   wxDefaultPosition, wxDefaultSize, Canvas::evalModeLabels );
 
     // Structure the layout with the sizers
     opSizer->Add( inputExpr,  1,  wxCENTER | wxALL, 5 );
@@ -132,6 +137,7 @@ mainFrame::mainFrame(const wxString& title) : wxFrame(nullptr, wxID_ANY,  title,
     opSizer->Add( inputRes,   0,  wxCENTER | wxALL, 5 );
     opSizer->Add( cbImag,     0,  wxCENTER | wxALL, 5 );
     opSizer->Add( chStyle,    0,  wxCENTER | wxALL, 5 );
+    opSizer->Add( chEval,     0,  wxCENTER | wxALL, 5 );
     ctlSizer->Add( opSizer,   1, wxEXPAND );
     mainSizer->Add( ctlSizer, 0,  wxEXPAND | wxALL, 5 );
     mainSizer->Add( canvas,   1,  wxEXPAND );
@@ -147,33 +153,10 @@ mainFrame::mainFrame(const wxString& title) : wxFrame(nullptr, wxID_ANY,  title,
     inputRes->SetRange(1, 1000);
     inputRes->SetIncrement(10);
     chStyle->SetSelection(0);
+    chEval->SetSelection(0);
     canvas->setResolution(inputRes->GetValue());
 
-    typedef std::complex<double> MyT; // We are parsing expressions in complex numbers
-
-    // Assign custom defined 1-arg functions to the expression parser class
-    Expr<MyT>::funcs1 = {
-        {   "sin", [](MyT x) { return sin(x); } },
-        {   "cos", [](MyT x) { return cos(x); } },
-        {   "log", [](MyT x) { return log(x); } },
-        {    "ln", [](MyT x) { return log(x); } },
-        {   "exp", [](MyT x) { return exp(x); } },
-        {  "sqrt", [](MyT x) { return sqrt(x); } },
-        {   "tan", [](MyT x) { return tan(x); } },
-        {  "atan", [](MyT x) { return atan(x); } },
-        {  "asin", [](MyT x) { return asin(x); } },
-        {  "acos", [](MyT x) { return acos(x); } },
-        {   "abs", [](MyT x) { return (MyT) abs(x); } },
-        {    "re", [](MyT x) { return (MyT) x.real(); } },
-        {    "im", [](MyT x) { return (MyT) x.imag(); } },
-        {  "conj", [](MyT x) { return conj(x); } },
-    };
-
-    // 2-arg functions. "Fake" max/min....
-    Expr<MyT>::funcs2 = {
-        { "max", [](MyT x, MyT y) { return x.real() > y.real() ? x : y; } },
-        { "min", [](MyT x, MyT y) { return x.real() < y.real() ? x : y; } },
-    };
+    registerFunctions();
 }
 
 mainFrame::~mainFrame() {}
@@ -233,6 +216,12 @@ void mainFrame::OnChoiceStyle(wxCommandEvent& event)
     event.Skip();
 }
 
+void mainFrame::OnChoiceEval(wxCommandEvent& event)
+{
+    canvas->setEvalMode((Canvas::EvalMode) chEval->GetSelection());
+    event.Skip();
+}
+
 void mainFrame::OnCheckBoxImag(wxCommandEvent& event)
 {
     canvas->setGraphImag(cbImag->GetValue());
@@ -269,6 +258,14 @@ void mainFrame::OnMenuLog(wxCommandEvent& event)
     logWin->GetFrame()->SetFocus();
 }
 
+void mainFrame::OnMenuCache(wxCommandEvent& event)
+{
+    long size = wxGetNumberFromUser("Memory for the points of recent expressions and views, in MB.",
+                                    "Size:", "Cache", canvas->getCacheSize(), 0, 65536, this);
+    if (size >= 0)
+        canvas->setCacheSize(size);
+}
+
 void mainFrame::OnMenuQuit(wxCommandEvent& event)
 {
     Close(true);
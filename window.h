@@ -11,6 +11,7 @@
 #include "wx/wx.h"
 #include "wx/sizer.h"
 #include "wx/spinctrl.h"
+#include "wx/numdlg.h"
 
 // Some IDs for wxWidgets elements
 #define ID_INP_EXPR  10002
@@ -20,6 +21,8 @@
 #define ID_CB_IMAG   10006
 #define ID_SP_RES    10007
 #define ID_MENU_LOG  10008
+#define ID_CH_EVAL   10009
+#define ID_MENU_CACHE 10010
 
 class Canvas;
 
@@ -37,7 +40,7 @@ private:
     wxTextCtrl *inputExpr;
     wxSpinCtrl *inputRes;
     wxCheckBox *cbImag;
-    wxChoice *chStyle;
+    wxChoice *chStyle, *chEval;
     wxLogWindow *logWin;
     bool resChanged;
 
@@ -46,6 +49,7 @@ private:
     void OnButtonPlot(wxCommandEvent&);
     void OnButtonClear(wxCommandEvent&);
     void OnChoiceStyle(wxCommandEvent&);
+    void OnChoiceEval(wxCommandEvent&);
     void OnCheckBoxImag(wxCommandEvent&);
     void OnSpinResolution(wxSpinEvent&);
     void OnKeyPress(wxKeyEvent&);
@@ -53,6 +57,7 @@ private:
     void OnMenuAbout(wxCommandEvent&);
     void OnMenuQuit(wxCommandEvent&);
     void OnMenuLog(wxCommandEvent&);
+    void OnMenuCache(wxCommandEvent&);
 
     wxDECLARE_EVENT_TABLE();
 };